@@ -41,6 +41,7 @@ typedef enum {
 	MSGPACK_OBJECT_RAW					= 0x05,
 	MSGPACK_OBJECT_ARRAY				= 0x06,
 	MSGPACK_OBJECT_MAP					= 0x07,
+	MSGPACK_OBJECT_EXT					= 0x08,
 } msgpack_object_type;
 
 
@@ -62,6 +63,12 @@ typedef struct {
 	const char* ptr;
 } msgpack_object_raw;
 
+typedef struct {
+	int8_t type;
+	uint32_t size;
+	const char* ptr;
+} msgpack_object_ext;
+
 typedef union {
 	bool boolean;
 	uint64_t u64;
@@ -70,6 +77,7 @@ typedef union {
 	msgpack_object_array array;
 	msgpack_object_map map;
 	msgpack_object_raw raw;
+	msgpack_object_ext ext;
 } msgpack_object_union;
 
 typedef struct msgpack_object {
@@ -43,6 +43,7 @@ namespace type {
 		RAW					= MSGPACK_OBJECT_RAW,
 		ARRAY				= MSGPACK_OBJECT_ARRAY,
 		MAP					= MSGPACK_OBJECT_MAP,
+		EXT					= MSGPACK_OBJECT_EXT,
 	};
 }
 
@@ -65,6 +66,12 @@ struct object_raw {
 	const char* ptr;
 };
 
+struct object_ext {
+	int8_t type;
+	uint32_t size;
+	const char* ptr;
+};
+
 struct object {
 	union union_type {
 		bool boolean;
@@ -75,6 +82,7 @@ struct object {
 		object_map map;
 		object_raw raw;
 		object_raw ref;  // obsolete
+		object_ext ext;
 	};
 
 	type::object_type type;
@@ -379,6 +387,11 @@ packer<Stream>& operator<< (packer<Stream>& o, const object& v)
 		o.pack_raw_body(v.via.raw.ptr, v.via.raw.size);
 		return o;
 
+	case type::EXT:
+		o.pack_ext(v.via.ext.size, v.via.ext.type);
+		o.pack_ext_body(v.via.ext.ptr, v.via.ext.size);
+		return o;
+
 	case type::ARRAY:
 		o.pack_array(v.via.array.size);
 		for(object* p(v.via.array.ptr),
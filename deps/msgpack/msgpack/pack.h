@@ -93,6 +93,9 @@ static int msgpack_pack_map(msgpack_packer* pk, unsigned int n);
 static int msgpack_pack_raw(msgpack_packer* pk, size_t l);
 static int msgpack_pack_raw_body(msgpack_packer* pk, const void* b, size_t l);
 
+static int msgpack_pack_ext(msgpack_packer* pk, size_t l, int8_t type);
+static int msgpack_pack_ext_body(msgpack_packer* pk, const void* b, size_t l);
+
 int msgpack_pack_object(msgpack_packer* pk, msgpack_object d);
 
 
@@ -77,6 +77,9 @@ public:
 	packer<Stream>& pack_raw(size_t l);
 	packer<Stream>& pack_raw_body(const char* b, size_t l);
 
+	packer<Stream>& pack_ext(size_t l, int8_t type);
+	packer<Stream>& pack_ext_body(const char* b, size_t l);
+
 private:
 	static void _pack_uint8(Stream& x, uint8_t d);
 	static void _pack_uint16(Stream& x, uint16_t d);
@@ -118,6 +121,8 @@ private:
 
 	static void _pack_raw(Stream& x, size_t l);
 	static void _pack_raw_body(Stream& x, const void* b, size_t l);
+	static void _pack_ext(Stream& x, size_t l, int8_t type);
+	static void _pack_ext_body(Stream& x, const void* b, size_t l);
 
 	static void append_buffer(Stream& x, const unsigned char* buf, unsigned int len)
 		{ x.write((const char*)buf, len); }
@@ -311,6 +316,14 @@ template <typename Stream>
 inline packer<Stream>& packer<Stream>::pack_raw_body(const char* b, size_t l)
 { _pack_raw_body(m_stream, b, l); return *this; }
 
+template <typename Stream>
+inline packer<Stream>& packer<Stream>::pack_ext(size_t l, int8_t type)
+{ _pack_ext(m_stream, l, type); return *this; }
+
+template <typename Stream>
+inline packer<Stream>& packer<Stream>::pack_ext_body(const char* b, size_t l)
+{ _pack_ext_body(m_stream, b, l); return *this; }
+
 
 }  // namespace msgpack
 
@@ -746,6 +746,61 @@ msgpack_pack_inline_func(_raw_body)(msgpack_pack_user x, const void* b, size_t l
 	msgpack_pack_append_buffer(x, (const unsigned char*)b, (unsigned int)(l));
 }
 
+
+/*
+ * Ext
+ */
+
+msgpack_pack_inline_func(_ext)(msgpack_pack_user x, size_t l, int8_t type)
+{
+	switch(l) {
+	case 1: {
+		unsigned char buf[2];
+		buf[0] = 0xd4; buf[1] = (unsigned char)type;
+		msgpack_pack_append_buffer(x, buf, 2);
+	} break;
+	case 2: {
+		unsigned char buf[2];
+		buf[0] = 0xd5; buf[1] = (unsigned char)type;
+		msgpack_pack_append_buffer(x, buf, 2);
+	} break;
+	case 4: {
+		unsigned char buf[2];
+		buf[0] = 0xd6; buf[1] = (unsigned char)type;
+		msgpack_pack_append_buffer(x, buf, 2);
+	} break;
+	case 8: {
+		unsigned char buf[2];
+		buf[0] = 0xd7; buf[1] = (unsigned char)type;
+		msgpack_pack_append_buffer(x, buf, 2);
+	} break;
+	case 16: {
+		unsigned char buf[2];
+		buf[0] = 0xd8; buf[1] = (unsigned char)type;
+		msgpack_pack_append_buffer(x, buf, 2);
+	} break;
+	default:
+		if(l < 256) {
+			unsigned char buf[3];
+			buf[0] = 0xc7; buf[1] = (unsigned char)l; buf[2] = (unsigned char)type;
+			msgpack_pack_append_buffer(x, buf, 3);
+		} else if(l < 65536) {
+			unsigned char buf[4];
+			buf[0] = 0xc8; _msgpack_store16(&buf[1], (uint16_t)l); buf[3] = (unsigned char)type;
+			msgpack_pack_append_buffer(x, buf, 4);
+		} else {
+			unsigned char buf[6];
+			buf[0] = 0xc9; _msgpack_store32(&buf[1], (uint32_t)l); buf[5] = (unsigned char)type;
+			msgpack_pack_append_buffer(x, buf, 6);
+		}
+	}
+}
+
+msgpack_pack_inline_func(_ext_body)(msgpack_pack_user x, const void* b, size_t l)
+{
+	msgpack_pack_append_buffer(x, (const unsigned char*)b, (unsigned int)(l));
+}
+
 #undef msgpack_pack_inline_func
 #undef msgpack_pack_user
 #undef msgpack_pack_append_buffer
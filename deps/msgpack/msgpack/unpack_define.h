@@ -33,6 +33,13 @@ extern "C" {
 #define MSGPACK_EMBED_STACK_SIZE 32
 #endif
 
+/* the stack starts out embedded in the context and is moved to the heap if
+ * containers nest deeper than MSGPACK_EMBED_STACK_SIZE; deeper than the
+ * context's max_depth, which starts out as MSGPACK_MAX_DEPTH, is an error */
+#ifndef MSGPACK_MAX_DEPTH
+#define MSGPACK_MAX_DEPTH 512
+#endif
+
 
 typedef enum {
 	CS_HEADER            = 0x00,  // nil
@@ -44,10 +51,10 @@ typedef enum {
 	//CS_                = 0x04,
 	//CS_                = 0x05,
 	//CS_                = 0x06,
-	//CS_                = 0x07,
+	CS_EXT_8             = 0x07,
 
-	//CS_                = 0x08,
-	//CS_                = 0x09,
+	CS_EXT_16            = 0x08,
+	CS_EXT_32            = 0x09,
 	CS_FLOAT             = 0x0a,
 	CS_DOUBLE            = 0x0b,
 	CS_UINT_8            = 0x0c,
@@ -75,6 +82,7 @@ typedef enum {
 	//ACS_BIG_INT_VALUE,
 	//ACS_BIG_FLOAT_VALUE,
 	ACS_RAW_VALUE,
+	ACS_EXT_VALUE,
 } msgpack_unpack_state;
 
 
@@ -40,6 +40,31 @@
 #error msgpack_unpack_user type is not defined
 #endif
 
+/* define MSGPACK_UNPACK_RAW_KEY to have raw map keys passed to the _raw_key
+ * callback instead of _raw */
+
+/* define MSGPACK_UNPACK_ARRAY_BULK to offer each non-empty array to the
+ * _array_bulk callback before its items are parsed. The callback is given
+ * the bytes that follow the header; it returns 1 if it decoded the whole
+ * array from them (setting the object and the number of bytes it used), 0 to
+ * have the items parsed as usual, or -1 if it needs more bytes than there
+ * are (setting how many). In the last case execution stops at the header,
+ * with the number of bytes needed from there left in ctx->trail. Arrays are
+ * only offered below max_depth and when their whole header is in the input
+ * of the current call, so that the header can be returned to; a request that
+ * will not fit in ctx->trail has the items parsed as usual. */
+
+/* define MSGPACK_UNPACK_TRACK_DEPTH to have ctx->depth record how deep the
+ * containers have nested, counting the outermost one as 1 */
+
+/* define msgpack_unpack_stack_init(s, n) to construct the n stack entries
+ * at s that are added when the stack grows, if msgpack_unpack_object must
+ * not simply be zeroed. Existing entries are moved with memcpy/realloc, so
+ * the object type must still be trivially copyable. */
+#ifndef msgpack_unpack_stack_init
+#define msgpack_unpack_stack_init(s, n) memset((s), 0, sizeof(*(s)) * (n))
+#endif
+
 #ifndef USE_CASE_RANGE
 #if !defined(_MSC_VER)
 #define USE_CASE_RANGE
@@ -58,12 +83,13 @@ msgpack_unpack_struct_decl(_context) {
 	unsigned int cs;
 	unsigned int trail;
 	unsigned int top;
-	/*
 	msgpack_unpack_struct(_stack)* stack;
 	unsigned int stack_size;
+	unsigned int max_depth;
+#ifdef MSGPACK_UNPACK_TRACK_DEPTH
+	unsigned int depth;
+#endif
 	msgpack_unpack_struct(_stack) embed_stack[MSGPACK_EMBED_STACK_SIZE];
-	*/
-	msgpack_unpack_struct(_stack) stack[MSGPACK_EMBED_STACK_SIZE];
 };
 
 
@@ -72,21 +98,24 @@ msgpack_unpack_func(void, _init)(msgpack_unpack_struct(_context)* ctx)
 	ctx->cs = CS_HEADER;
 	ctx->trail = 0;
 	ctx->top = 0;
-	/*
 	ctx->stack = ctx->embed_stack;
 	ctx->stack_size = MSGPACK_EMBED_STACK_SIZE;
-	*/
+	ctx->max_depth = MSGPACK_MAX_DEPTH;
+#ifdef MSGPACK_UNPACK_TRACK_DEPTH
+	ctx->depth = 0;
+#endif
 	ctx->stack[0].obj = msgpack_unpack_callback(_root)(&ctx->user);
 }
 
-/*
+/* frees the stack if it outgrew embed_stack; call before _init to reuse ctx */
 msgpack_unpack_func(void, _destroy)(msgpack_unpack_struct(_context)* ctx)
 {
-	if(ctx->stack_size != MSGPACK_EMBED_STACK_SIZE) {
+	if(ctx->stack != ctx->embed_stack) {
 		free(ctx->stack);
+		ctx->stack = ctx->embed_stack;
+		ctx->stack_size = MSGPACK_EMBED_STACK_SIZE;
 	}
 }
-*/
 
 msgpack_unpack_func(msgpack_unpack_object, _data)(msgpack_unpack_struct(_context)* ctx)
 {
@@ -101,14 +130,15 @@ msgpack_unpack_func(int, _execute)(msgpack_unpack_struct(_context)* ctx, const c
 	const unsigned char* p = (unsigned char*)data + *off;
 	const unsigned char* const pe = (unsigned char*)data + len;
 	const void* n = NULL;
+#ifdef MSGPACK_UNPACK_ARRAY_BULK
+	const unsigned char* const ps = p;
+#endif
 
 	unsigned int trail = ctx->trail;
 	unsigned int cs = ctx->cs;
 	unsigned int top = ctx->top;
 	msgpack_unpack_struct(_stack)* stack = ctx->stack;
-	/*
 	unsigned int stack_size = ctx->stack_size;
-	*/
 	msgpack_unpack_user* user = &ctx->user;
 
 	msgpack_unpack_object obj;
@@ -137,8 +167,29 @@ msgpack_unpack_func(int, _execute)(msgpack_unpack_struct(_context)* ctx, const c
 	cs = _cs; \
 	goto _fixed_trail_again
 
+#ifdef MSGPACK_UNPACK_TRACK_DEPTH
+#define track_depth() if(top >= ctx->depth) { ctx->depth = top + 1; }
+#else
+#define track_depth()
+#endif
+
 #define start_container(func, count_, ct_) \
-	if(top >= MSGPACK_EMBED_STACK_SIZE) { goto _failed; } /* FIXME */ \
+	if(top >= ctx->max_depth) { goto _failed; } \
+	track_depth(); \
+	if(top >= stack_size) { \
+		size_t csize = sizeof(msgpack_unpack_struct(_stack)) * stack_size; \
+		msgpack_unpack_struct(_stack)* tmp; \
+		if(stack == ctx->embed_stack) { \
+			tmp = (msgpack_unpack_struct(_stack)*)malloc(csize * 2); \
+			if(tmp != NULL) { memcpy(tmp, stack, csize); } \
+		} else { \
+			tmp = (msgpack_unpack_struct(_stack)*)realloc(stack, csize * 2); \
+		} \
+		if(tmp == NULL) { goto _failed; } \
+		msgpack_unpack_stack_init(tmp + stack_size, stack_size); \
+		ctx->stack = stack = tmp; \
+		ctx->stack_size = stack_size = stack_size * 2; \
+	} \
 	if(msgpack_unpack_callback(func)(user, count_, &stack[top].obj) < 0) { goto _failed; } \
 	if((count_) == 0) { obj = stack[top].obj; goto _push; } \
 	stack[top].ct = ct_; \
@@ -146,27 +197,28 @@ msgpack_unpack_func(int, _execute)(msgpack_unpack_struct(_context)* ctx, const c
 	++top; \
 	/*printf("container %d count %d stack %d\n",stack[top].obj,count_,top);*/ \
 	/*printf("stack push %d\n", top);*/ \
-	/* FIXME \
-	if(top >= stack_size) { \
-		if(stack_size == MSGPACK_EMBED_STACK_SIZE) { \
-			size_t csize = sizeof(msgpack_unpack_struct(_stack)) * MSGPACK_EMBED_STACK_SIZE; \
-			size_t nsize = csize * 2; \
-			msgpack_unpack_struct(_stack)* tmp = (msgpack_unpack_struct(_stack)*)malloc(nsize); \
-			if(tmp == NULL) { goto _failed; } \
-			memcpy(tmp, ctx->stack, csize); \
-			ctx->stack = stack = tmp; \
-			ctx->stack_size = stack_size = MSGPACK_EMBED_STACK_SIZE * 2; \
-		} else { \
-			size_t nsize = sizeof(msgpack_unpack_struct(_stack)) * ctx->stack_size * 2; \
-			msgpack_unpack_struct(_stack)* tmp = (msgpack_unpack_struct(_stack)*)realloc(ctx->stack, nsize); \
-			if(tmp == NULL) { goto _failed; } \
-			ctx->stack = stack = tmp; \
-			ctx->stack_size = stack_size = stack_size * 2; \
-		} \
-	} \
-	*/ \
 	goto _header_again
 
+#ifdef MSGPACK_UNPACK_ARRAY_BULK
+#define array_bulk(count_, header_len) \
+	if((count_) > 0 && top < ctx->max_depth && \
+			(size_t)(p - ps) >= (header_len) - 1) { \
+		size_t bulk_; \
+		int bulk_ret_ = msgpack_unpack_callback(_array_bulk)(user, count_, \
+			(const char*)p + 1, (size_t)(pe - p - 1), &bulk_, &obj); \
+		if(bulk_ret_ > 0) { p += bulk_; goto _push; } \
+		if(bulk_ret_ < 0 && \
+				bulk_ <= (size_t)(unsigned int)-1 - (header_len)) { \
+			p -= (header_len) - 1; \
+			cs = CS_HEADER; \
+			trail = (header_len) + bulk_; \
+			goto _out; \
+		} \
+	}
+#else
+#define array_bulk(count_, header_len)
+#endif
+
 #define NEXT_CS(p) \
 	((unsigned int)*p & 0x1f)
 
@@ -204,9 +256,10 @@ msgpack_unpack_func(int, _execute)(msgpack_unpack_struct(_context)* ctx, const c
 				//case 0xc4:
 				//case 0xc5:
 				//case 0xc6:
-				//case 0xc7:
-				//case 0xc8:
-				//case 0xc9:
+				case 0xc7:  // ext  8
+				case 0xc8:  // ext 16
+				case 0xc9:  // ext 32
+					again_fixed_trail(NEXT_CS(p), 1 << ((((unsigned int)*p) + 1) & 0x03));
 				case 0xca:  // float
 				case 0xcb:  // double
 				case 0xcc:  // unsigned int  8
@@ -218,11 +271,16 @@ msgpack_unpack_func(int, _execute)(msgpack_unpack_struct(_context)* ctx, const c
 				case 0xd2:  // signed int 32
 				case 0xd3:  // signed int 64
 					again_fixed_trail(NEXT_CS(p), 1 << (((unsigned int)*p) & 0x03));
-				//case 0xd4:
-				//case 0xd5:
-				//case 0xd6:  // big integer 16
-				//case 0xd7:  // big integer 32
-				//case 0xd8:  // big float 16
+				case 0xd4:  // fixext  1
+					again_fixed_trail(ACS_EXT_VALUE, 2);
+				case 0xd5:  // fixext  2
+					again_fixed_trail(ACS_EXT_VALUE, 3);
+				case 0xd6:  // fixext  4
+					again_fixed_trail(ACS_EXT_VALUE, 5);
+				case 0xd7:  // fixext  8
+					again_fixed_trail(ACS_EXT_VALUE, 9);
+				case 0xd8:  // fixext 16
+					again_fixed_trail(ACS_EXT_VALUE, 17);
 				//case 0xd9:  // big float 32
 				case 0xda:  // raw 16
 				case 0xdb:  // raw 32
@@ -237,6 +295,7 @@ msgpack_unpack_func(int, _execute)(msgpack_unpack_struct(_context)* ctx, const c
 			SWITCH_RANGE(0xa0, 0xbf)  // FixRaw
 				again_fixed_trail_if_zero(ACS_RAW_VALUE, ((unsigned int)*p & 0x1f), _raw_zero);
 			SWITCH_RANGE(0x90, 0x9f)  // FixArray
+				array_bulk(((unsigned int)*p) & 0x0f, 1);
 				start_container(_array, ((unsigned int)*p) & 0x0f, CT_ARRAY_ITEM);
 			SWITCH_RANGE(0x80, 0x8f)  // FixMap
 				start_container(_map, ((unsigned int)*p) & 0x0f, CT_MAP_KEY);
@@ -308,18 +367,38 @@ msgpack_unpack_func(int, _execute)(msgpack_unpack_struct(_context)* ctx, const c
 				again_fixed_trail_if_zero(ACS_RAW_VALUE, _msgpack_load32(uint32_t,n), _raw_zero);
 			case ACS_RAW_VALUE:
 			_raw_zero:
+#ifdef MSGPACK_UNPACK_RAW_KEY
+				if(top > 0 && stack[top-1].ct == CT_MAP_KEY) {
+					push_variable_value(_raw_key, data, n, trail);
+				}
+#endif
 				push_variable_value(_raw, data, n, trail);
 
+			// ext payloads carry their type byte in front of the data,
+			// hence the +1 on the declared length
+			case CS_EXT_8:
+				again_fixed_trail(ACS_EXT_VALUE, *(uint8_t*)n + 1);
+			case CS_EXT_16:
+				again_fixed_trail(ACS_EXT_VALUE, _msgpack_load16(uint16_t,n) + 1);
+			case CS_EXT_32:
+				/* the +1 would wrap the trail round to 0 */
+				if(_msgpack_load32(uint32_t,n) == 0xffffffff) { goto _failed; }
+				again_fixed_trail(ACS_EXT_VALUE, _msgpack_load32(uint32_t,n) + 1);
+			case ACS_EXT_VALUE:
+				push_variable_value(_ext, data, n, trail);
+
 			case CS_ARRAY_16:
+				array_bulk(_msgpack_load16(uint16_t,n), 3);
 				start_container(_array, _msgpack_load16(uint16_t,n), CT_ARRAY_ITEM);
 			case CS_ARRAY_32:
-				/* FIXME security guard */
+				/* the _array and _map callbacks must vet counts before
+				 * allocating for them */
+				array_bulk(_msgpack_load32(uint32_t,n), 5);
 				start_container(_array, _msgpack_load32(uint32_t,n), CT_ARRAY_ITEM);
 
 			case CS_MAP_16:
 				start_container(_map, _msgpack_load16(uint16_t,n), CT_MAP_KEY);
 			case CS_MAP_32:
-				/* FIXME security guard */
 				start_container(_map, _msgpack_load32(uint32_t,n), CT_MAP_KEY);
 
 			default:
@@ -397,6 +476,10 @@ _end:
 #undef msgpack_unpack_struct
 #undef msgpack_unpack_object
 #undef msgpack_unpack_user
+#undef MSGPACK_UNPACK_RAW_KEY
+#undef MSGPACK_UNPACK_ARRAY_BULK
+#undef MSGPACK_UNPACK_TRACK_DEPTH
+#undef msgpack_unpack_stack_init
 
 #undef push_simple_value
 #undef push_fixed_value
@@ -404,6 +487,8 @@ _end:
 #undef again_fixed_trail
 #undef again_fixed_trail_if_zero
 #undef start_container
+#undef track_depth
+#undef array_bulk
 
 #undef NEXT_CS
 
@@ -55,12 +55,19 @@ typedef struct msgpack_zone {
 	msgpack_zone_chunk_list chunk_list;
 	msgpack_zone_finalizer_array finalizer_array;
 	size_t chunk_size;
+	size_t next_chunk_size;
 } msgpack_zone;
 
 #ifndef MSGPACK_ZONE_CHUNK_SIZE
 #define MSGPACK_ZONE_CHUNK_SIZE 8192
 #endif
 
+/* each chunk added to a zone is twice the size of the one before, up to
+ * this size, so that a large tree takes a handful of mallocs */
+#ifndef MSGPACK_ZONE_CHUNK_SIZE_MAX
+#define MSGPACK_ZONE_CHUNK_SIZE_MAX (8 * 1024 * 1024)
+#endif
+
 bool msgpack_zone_init(msgpack_zone* zone, size_t chunk_size);
 void msgpack_zone_destroy(msgpack_zone* zone);
 
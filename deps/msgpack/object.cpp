@@ -47,6 +47,10 @@ std::ostream& operator<< (std::ostream& s, const object o)
 		(s << '"').write(o.via.raw.ptr, o.via.raw.size) << '"';
 		break;
 
+	case type::EXT:
+		s << "(ext: " << (int)o.via.ext.type << ")";
+		break;
+
 	case type::ARRAY:
 		s << "[";
 		if(o.via.array.size != 0) {
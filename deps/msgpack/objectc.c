@@ -61,6 +61,13 @@ int msgpack_pack_object(msgpack_packer* pk, msgpack_object d)
 			return msgpack_pack_raw_body(pk, d.via.raw.ptr, d.via.raw.size);
 		}
 
+	case MSGPACK_OBJECT_EXT:
+		{
+			int ret = msgpack_pack_ext(pk, d.via.ext.size, d.via.ext.type);
+			if(ret < 0) { return ret; }
+			return msgpack_pack_ext_body(pk, d.via.ext.ptr, d.via.ext.size);
+		}
+
 	case MSGPACK_OBJECT_ARRAY:
 		{
 			int ret = msgpack_pack_array(pk, d.via.array.size);
@@ -128,6 +135,10 @@ void msgpack_object_print(FILE* out, msgpack_object o)
 		fprintf(out, "\"");
 		break;
 
+	case MSGPACK_OBJECT_EXT:
+		fprintf(out, "(ext: %i)", (int)o.via.ext.type);
+		break;
+
 	case MSGPACK_OBJECT_ARRAY:
 		fprintf(out, "[");
 		if(o.via.array.size != 0) {
@@ -192,6 +203,11 @@ bool msgpack_object_equal(const msgpack_object x, const msgpack_object y)
 		return x.via.raw.size == y.via.raw.size &&
 			memcmp(x.via.raw.ptr, y.via.raw.ptr, x.via.raw.size) == 0;
 
+	case MSGPACK_OBJECT_EXT:
+		return x.via.ext.type == y.via.ext.type &&
+			x.via.ext.size == y.via.ext.size &&
+			memcmp(x.via.ext.ptr, y.via.ext.ptr, x.via.ext.size) == 0;
+
 	case MSGPACK_OBJECT_ARRAY:
 		if(x.via.array.size != y.via.array.size) {
 			return false;
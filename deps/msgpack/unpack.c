@@ -27,6 +27,8 @@
 typedef struct {
 	msgpack_zone* z;
 	bool referenced;
+	size_t items_left;  // every item takes a byte, so the items declared but
+	                    // not yet read can never outnumber the input
 } unpack_user;
 
 
@@ -49,6 +51,8 @@ typedef struct template_context template_context;
 
 static void template_init(template_context* ctx);
 
+static void template_destroy(template_context* ctx);
+
 static msgpack_object template_data(template_context* ctx);
 
 static int template_execute(template_context* ctx,
@@ -103,6 +107,8 @@ static inline int template_callback_false(unpack_user* u, msgpack_object* o)
 
 static inline int template_callback_array(unpack_user* u, unsigned int n, msgpack_object* o)
 {
+	if(n > u->items_left) { return -1; }
+	u->items_left -= n;
 	o->type = MSGPACK_OBJECT_ARRAY;
 	o->via.array.size = 0;
 	o->via.array.ptr = (msgpack_object*)msgpack_zone_malloc(u->z, n*sizeof(msgpack_object));
@@ -111,10 +117,12 @@ static inline int template_callback_array(unpack_user* u, unsigned int n, msgpac
 }
 
 static inline int template_callback_array_item(unpack_user* u, msgpack_object* c, msgpack_object o)
-{ c->via.array.ptr[c->via.array.size++] = o; return 0; }
+{ c->via.array.ptr[c->via.array.size++] = o; ++u->items_left; return 0; }
 
 static inline int template_callback_map(unpack_user* u, unsigned int n, msgpack_object* o)
 {
+	if(n > u->items_left / 2) { return -1; }
+	u->items_left -= 2 * (size_t)n;
 	o->type = MSGPACK_OBJECT_MAP;
 	o->via.map.size = 0;
 	o->via.map.ptr = (msgpack_object_kv*)msgpack_zone_malloc(u->z, n*sizeof(msgpack_object_kv));
@@ -127,6 +135,7 @@ static inline int template_callback_map_item(unpack_user* u, msgpack_object* c,
 	c->via.map.ptr[c->via.map.size].key = k;
 	c->via.map.ptr[c->via.map.size].val = v;
 	++c->via.map.size;
+	u->items_left += 2;
 	return 0;
 }
 
@@ -139,6 +148,16 @@ static inline int template_callback_raw(unpack_user* u, const char* b, const cha
 	return 0;
 }
 
+static inline int template_callback_ext(unpack_user* u, const char* b, const char* p, unsigned int l, msgpack_object* o)
+{
+	o->type = MSGPACK_OBJECT_EXT;
+	o->via.ext.type = *p;
+	o->via.ext.ptr = p + 1;
+	o->via.ext.size = l - 1;
+	u->referenced = true;
+	return 0;
+}
+
 #include "msgpack/unpack_template.h"
 
 
@@ -212,6 +231,7 @@ bool msgpack_unpacker_init(msgpack_unpacker* mpac, size_t initial_buffer_size)
 	template_init(CTX_CAST(mpac->ctx));
 	CTX_CAST(mpac->ctx)->user.z = mpac->z;
 	CTX_CAST(mpac->ctx)->user.referenced = false;
+	CTX_CAST(mpac->ctx)->user.items_left = (size_t)-1;  // more input may follow
 
 	return true;
 }
@@ -219,6 +239,7 @@ bool msgpack_unpacker_init(msgpack_unpacker* mpac, size_t initial_buffer_size)
 void msgpack_unpacker_destroy(msgpack_unpacker* mpac)
 {
 	msgpack_zone_free(mpac->z);
+	template_destroy(CTX_CAST(mpac->ctx));
 	free(mpac->ctx);
 	decl_count(mpac->buffer);
 }
@@ -363,6 +384,7 @@ bool msgpack_unpacker_flush_zone(msgpack_unpacker* mpac)
 
 void msgpack_unpacker_reset(msgpack_unpacker* mpac)
 {
+	template_destroy(CTX_CAST(mpac->ctx));
 	template_init(CTX_CAST(mpac->ctx));
 	// don't reset referenced flag
 	mpac->parsed = 0;
@@ -407,8 +429,14 @@ msgpack_unpack(const char* data, size_t len, size_t* off,
 
 	ctx.user.z = result_zone;
 	ctx.user.referenced = false;
+	ctx.user.items_left = len - noff;
 
 	int e = template_execute(&ctx, data, len, &noff);
+	if(e > 0) {
+		*result = template_data(&ctx);
+	}
+	template_destroy(&ctx);
+
 	if(e < 0) {
 		return MSGPACK_UNPACK_PARSE_ERROR;
 	}
@@ -419,8 +447,6 @@ msgpack_unpack(const char* data, size_t len, size_t* off,
 		return MSGPACK_UNPACK_CONTINUE;
 	}
 
-	*result = template_data(&ctx);
-
 	if(noff < len) {
 		return MSGPACK_UNPACK_EXTRA_BYTES;
 	}
@@ -447,9 +473,11 @@ bool msgpack_unpack_next(msgpack_unpacked* result,
 
 	ctx.user.z = z;
 	ctx.user.referenced = false;
+	ctx.user.items_left = len - noff;
 
 	int e = template_execute(&ctx, data, len, &noff);
 	if(e <= 0) {
+		template_destroy(&ctx);
 		msgpack_zone_free(z);
 		return false;
 	}
@@ -458,6 +486,7 @@ bool msgpack_unpack_next(msgpack_unpacked* result,
 
 	result->zone = z;
 	result->data = template_data(&ctx);
+	template_destroy(&ctx);
 
 	return true;
 }
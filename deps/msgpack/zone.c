@@ -66,7 +66,7 @@ static inline void clear_chunk_list(msgpack_zone_chunk_list* cl, size_t chunk_si
 			break;
 		}
 	}
-	cl->head->next = NULL;
+	cl->head = c;
 	cl->free = chunk_size;
 	cl->ptr  = ((char*)cl->head) + sizeof(msgpack_zone_chunk);
 }
@@ -75,7 +75,7 @@ void* msgpack_zone_malloc_expand(msgpack_zone* zone, size_t size)
 {
 	msgpack_zone_chunk_list* const cl = &zone->chunk_list;
 
-	size_t sz = zone->chunk_size;
+	size_t sz = zone->next_chunk_size;
 
 	while(sz < size) {
 		sz *= 2;
@@ -83,6 +83,13 @@ void* msgpack_zone_malloc_expand(msgpack_zone* zone, size_t size)
 
 	msgpack_zone_chunk* chunk = (msgpack_zone_chunk*)malloc(
 			sizeof(msgpack_zone_chunk) + sz);
+	if(chunk == NULL) {
+		return NULL;
+	}
+
+	if(sz < MSGPACK_ZONE_CHUNK_SIZE_MAX) {
+		zone->next_chunk_size = sz * 2;
+	}
 
 	char* ptr = ((char*)chunk) + sizeof(msgpack_zone_chunk);
 
@@ -177,11 +184,13 @@ void msgpack_zone_clear(msgpack_zone* zone)
 {
 	clear_finalizer_array(&zone->finalizer_array);
 	clear_chunk_list(&zone->chunk_list, zone->chunk_size);
+	zone->next_chunk_size = zone->chunk_size * 2;
 }
 
 bool msgpack_zone_init(msgpack_zone* zone, size_t chunk_size)
 {
 	zone->chunk_size = chunk_size;
+	zone->next_chunk_size = chunk_size * 2;
 
 	if(!init_chunk_list(&zone->chunk_list, chunk_size)) {
 		return false;
@@ -201,6 +210,7 @@ msgpack_zone* msgpack_zone_new(size_t chunk_size)
 	}
 
 	zone->chunk_size = chunk_size;
+	zone->next_chunk_size = chunk_size * 2;
 
 	if(!init_chunk_list(&zone->chunk_list, chunk_size)) {
 		free(zone);
@@ -14,9 +14,28 @@ try {
 
 var bpack = mpBindings.pack;
 var unpack = mpBindings.unpack;
+var unpackAll = mpBindings.unpackAll;
+var Decoder = mpBindings.Decoder;
+var IncrementalPacker = mpBindings.IncrementalPacker;
+
+// Run fn once pending I/O has had a chance to run
+var defer = (typeof setImmediate === 'function') ?
+    setImmediate : process.nextTick;
 
 exports.pack = pack;
+exports.packWithOptions = mpBindings.packWithOptions;
+exports.packInto = mpBindings.packInto;
+exports.packIncremental = packIncremental;
 exports.unpack = unpack;
+exports.unpackAt = mpBindings.unpackAt;
+exports.unpackAll = unpackAll;
+exports.unpackAsync = mpBindings.unpackAsync;
+exports.unpackLazy = mpBindings.unpackLazy;
+exports.get = mpBindings.get;
+exports.validate = mpBindings.validate;
+exports.IncrementalPacker = IncrementalPacker;
+exports.PackedArray = mpBindings.PackedArray;
+exports.Decoder = Decoder;
 
 function pack() {
     var args = arguments, that, i;
@@ -30,13 +49,46 @@ function pack() {
     return bpack.apply(null, args);
 }
 
+// Pack obj a slice at a time, yielding to the event loop between slices,
+// then call cb(err, buf). The resulting bytes are the same as pack(obj).
+//
+// Each slice packs at most options.maxNodes values (default 10000) for at
+// most options.maxMillis milliseconds (default 5). obj must not be modified
+// until cb has been called.
+function packIncremental(obj, options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = {};
+    }
+
+    var maxNodes = options.maxNodes || 10000;
+    var maxMillis = options.maxMillis || 5;
+    var packer = new IncrementalPacker(obj);
+
+    function step() {
+        var done;
+        try {
+            done = packer.step(maxNodes, maxMillis);
+        } catch (e) {
+            return cb(e);
+        }
+
+        if (done) {
+            return cb(null, packer.buffer());
+        }
+        defer(step);
+    }
+
+    defer(step);
+}
+
 var Stream = function(s) {
     var self = this;
 
     events.EventEmitter.call(self);
 
-    // Buffer of incomplete stream data
-    self.buf = null;
+    // Decoder holding any incomplete message from the stream
+    var decoder = new Decoder();
 
     // Send a message down the stream
     //
@@ -55,34 +107,9 @@ var Stream = function(s) {
     // Listen for data from the underlying stream, consuming it and emitting
     // 'msg' events as we find whole messages.
     s.addListener('data', function(d) {
-        // Make sure that self.buf reflects the entirety of the unread stream
-        // of bytes; it needs to be a single buffer
-        if (self.buf) {
-            var b = new buffer.Buffer(self.buf.length + d.length);
-            self.buf.copy(b, 0, 0, self.buf.length);
-            d.copy(b, self.buf.length, 0, d.length);
-
-            self.buf = b;
-        } else {
-            self.buf = d;
-        }
-
-        // Consume messages from the stream, one by one
-        while (self.buf && self.buf.length > 0) {
-            var msg = unpack(self.buf);
-            if (!msg) {
-                break;
-            }
-
-            self.emit('msg', msg);
-            if (unpack.bytes_remaining > 0) {
-                self.buf = self.buf.slice(
-                    self.buf.length - unpack.bytes_remaining,
-                    self.buf.length
-                );
-            } else {
-                self.buf = null;
-            }
+        var msgs = decoder.write(d);
+        for (var i = 0; i < msgs.length; i++) {
+            self.emit('msg', msgs[i]);
         }
     });
 };
@@ -1,11 +1,17 @@
 #include <v8.h>
 #include <node.h>
 #include <node_buffer.h>
+#include <node_version.h>
 #include <msgpack.h>
+#include <msgpack/unpack_define.h>
+#include <uv.h>
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include <stack>
+#include <new>
 
 using namespace std;
 using namespace v8;
@@ -13,40 +19,249 @@ using namespace node;
 
 #define SBUF_POOL 50000
 
+// Ext type of a string table reference; its payload is the big-endian
+// index of an earlier raw value (1, 2 or 4 bytes).
+#define MSGPACK_EXT_STRING_REF 0
+
+// Raw values shorter than this are never entered in the string table.
+#define STRING_TABLE_MIN_LENGTH 4
+
+// Slots a string table starts with; it doubles once three quarters are used
+#define STRING_TABLE_INITIAL_SLOTS 64
+
+// PackContext::max_bytes when there is no maxBytes option
+#define MAX_BYTES_UNLIMITED ((size_t) -1)
+
+// Arrays and maps are converted this many items per HandleScope, so that the
+// handles of a huge container are released as we go instead of piling up
+// until the whole conversion is done.
+#define HANDLE_SCOPE_BATCH 256
+
+// unpack() parses this many bytes per HandleScope, for the same reason
+#define UNPACK_CHUNK 16384
+
+// Number of slots in the map key cache (a power of two), and the longest key
+// that is cached.
+#define KEY_CACHE_SIZE 1024
+#define KEY_CACHE_MAX_LENGTH 32
+
+// Shortest array of numbers that the typedArrays option turns into a typed
+// array.
+#define TYPED_ARRAY_MIN_LENGTH 16
+
+// Number of slots in the map shape cache (a power of two), and the most
+// pairs a map can have to be cached.
+#define SHAPE_CACHE_SIZE 256
+#define SHAPE_MAX_PAIRS 64
+
+// Shortest raw value that the externalStrings option keeps out of the V8 heap
+#define EXTERNAL_STRING_MIN_LENGTH 1024
+
+// Size of the first chunk of a pack() zone, and how many bytes of zone
+// unpackAsync() starts with per byte of input; a msgpack_object tree takes a
+// small multiple of the space of its packed form. Zones double their chunks
+// as they grow, so an estimate that is off costs only a malloc or two.
+#define PACK_ZONE_CHUNK_SIZE 1024
+#define ZONE_BYTES_PER_INPUT_BYTE 8
+
 // MSC does not support C99 trunc function.
 #ifdef _MSC_BUILD
 double trunc(double d){ return (d>0) ? floor(d) : ceil(d) ; }
 #endif
 
 static Persistent<FunctionTemplate> msgpack_unpack_template;
-
-// An exception class that wraps a textual message
+static Persistent<Function> msgpack_unpack_function;
+static Persistent<Function> buffer_constructor;
+static Persistent<Function> int32_array_constructor;
+static Persistent<Function> float64_array_constructor;
+static Persistent<Function> map_constructor;
+static Persistent<Function> map_set_function;
+
+// An exception class that wraps a textual message; it is thrown to
+// JavaScript as a TypeError unless another error constructor is given. The
+// message is only made into a V8 string once caught, as the HandleScope it
+// was thrown from may be gone by then.
 class MsgpackException {
     public:
-        MsgpackException(const char *str) :
-            msg(String::New(str)) {
+        MsgpackException(const char *str,
+                         Local<Value> (*error)(Handle<String>) = Exception::TypeError) :
+            msg(str), error(error) {
         }
 
         Handle<Value> getThrownException() {
-            return Exception::TypeError(msg);
+            return error(String::New(msg));
         }
 
     private:
-        const Handle<String> msg;
+        const char *msg;
+        Local<Value> (*error)(Handle<String>);
 };
 
-// A holder for a msgpack_zone object; ensures destruction on scope exit
+// A holder for a msgpack_zone object; ensures destruction on scope exit.
+// ok is false, and the zone must not be used, if its first chunk could not be
+// allocated.
 class MsgpackZone {
     public:
         msgpack_zone _mz;
+        bool ok;
 
-        MsgpackZone(size_t sz = 1024) {
-            msgpack_zone_init(&this->_mz, sz);
+        MsgpackZone(size_t sz = PACK_ZONE_CHUNK_SIZE) {
+            ok = msgpack_zone_init(&this->_mz, sz);
         }
 
         ~MsgpackZone() {
-            msgpack_zone_destroy(&this->_mz);
+            if (ok) {
+                msgpack_zone_destroy(&this->_mz);
+            }
+        }
+};
+
+// Raw values written so far by a pack() using the stringTable option.
+//
+// Every raw value of at least STRING_TABLE_MIN_LENGTH bytes that is written
+// inline takes the next index, and unpack() numbers them the same way, so a
+// MSGPACK_EXT_STRING_REF can name any earlier value.
+//
+// Values are found by hashing their bytes into an open-addressed table that
+// only points at them, so looking one up neither copies nor allocates. The
+// bytes must stay put until the pack() call is over; they are in its zone,
+// or in a Buffer that PackContext holds on to.
+class MsgpackStringTable {
+    public:
+        MsgpackStringTable() : count(0), used(0),
+            slots(STRING_TABLE_INITIAL_SLOTS) {}
+
+        // Returns true and sets index if these bytes were already written;
+        // otherwise records them, as they are about to be written inline
+        bool find_or_add(const char *ptr, uint32_t size, uint32_t *index) {
+            uint32_t h = hash(ptr, size);
+            size_t i = probe(ptr, size, h);
+
+            if (slots[i].ptr != NULL) {
+                *index = slots[i].index;
+                return true;
+            }
+
+            Entry e = { ptr, size, h, count++ };
+            slots[i] = e;
+            if (4 * ++used > 3 * slots.size()) {
+                grow();
+            }
+            return false;
+        }
+
+        // Counts a value that was found but is written inline again, and so
+        // takes an index of its own; references keep using the first one
+        void add_repeat() {
+            count++;
+        }
+
+    private:
+        struct Entry {
+            const char *ptr;            // NULL for an empty slot
+            uint32_t size;
+            uint32_t hash;
+            uint32_t index;
+        };
+
+        // FNV-1a
+        static uint32_t hash(const char *ptr, uint32_t size) {
+            uint32_t h = 2166136261u;
+            for (uint32_t i = 0; i < size; i++) {
+                h = (h ^ static_cast<unsigned char>(ptr[i])) * 16777619u;
+            }
+            return h;
+        }
+
+        // The slot holding these bytes, or the empty slot where they belong
+        size_t probe(const char *ptr, uint32_t size, uint32_t h) const {
+            size_t mask = slots.size() - 1;
+            size_t i = h & mask;
+
+            while (slots[i].ptr != NULL &&
+                   (slots[i].hash != h || slots[i].size != size ||
+                    memcmp(slots[i].ptr, ptr, size) != 0)) {
+                i = (i + 1) & mask;
+            }
+            return i;
+        }
+
+        void grow() {
+            vector<Entry> old(2 * slots.size());
+            old.swap(slots);
+
+            size_t mask = slots.size() - 1;
+            for (size_t j = 0; j < old.size(); j++) {
+                if (old[j].ptr == NULL) {
+                    continue;
+                }
+
+                size_t i = old[j].hash & mask;
+                while (slots[i].ptr != NULL) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = old[j];
+            }
         }
+
+        uint32_t count;                 // indices handed out so far
+        size_t used;                    // slots in use
+        vector<Entry> slots;            // a power of two of them
+};
+
+// State for a single pack() call
+struct PackContext {
+    msgpack_zone *mz;
+    MsgpackStringTable *strings;    // NULL unless packing with stringTable
+    size_t bytes;                   // packed size of the objects so far
+    size_t max_bytes;               // limit set by the maxBytes option
+
+    // Buffers whose data is packed in place, kept alive until packing is
+    // over. The array is made at the first one, which may be seen in a
+    // HandleScope that closes before then.
+    Persistent<Array> buffers;
+    uint32_t buffer_count;
+
+    PackContext(msgpack_zone *mz) :
+        mz(mz), strings(NULL), bytes(0), max_bytes(MAX_BYTES_UNLIMITED),
+        buffer_count(0) {}
+
+    ~PackContext() {
+        buffers.Dispose();
+    }
+};
+
+// Options accepted by unpack(buf, options)
+struct UnpackOptions {
+    bool string_table;
+    bool buffers;
+    bool typed_arrays;
+    uint32_t max_depth;             // deepest nesting allowed
+    uint32_t max_length;            // most items in an array or pairs in a map
+    uint32_t max_string_length;     // longest raw value
+    size_t max_bytes;               // largest packed size of an object
+    size_t zone_chunk_size;         // first zone chunk, or 0 to guess
+    bool external_strings;
+    bool maps;                      // make ES Maps rather than objects...
+    uint32_t map_threshold;         // ...of this many pairs, or any size
+                                    // with keys other than strings
+
+    UnpackOptions() : string_table(false), buffers(false), typed_arrays(false),
+        max_depth(MSGPACK_MAX_DEPTH), max_length(0xffffffff),
+        max_string_length(0xffffffff), max_bytes(MAX_BYTES_UNLIMITED),
+        zone_chunk_size(0), external_strings(false), maps(false),
+        map_threshold(0) {}
+};
+
+// State for a single unpack() call
+struct UnpackContext {
+    UnpackOptions opts;
+    Local<Array> strings;           // interned raw values, by table index
+    uint32_t string_count;
+    Local<Object> buffer;           // the input, when unpacking with buffers
+    Local<Function> slice;          // and its slice() method
+
+    UnpackContext() : string_count(0) {}
 };
 
 static stack<msgpack_sbuffer *> sbuffers;
@@ -88,6 +303,156 @@ _free_sbuf(char *data, void *hint) {
     }
 }
 
+// Raw values of at least STRING_TABLE_MIN_LENGTH bytes that have been seen
+// before become a MSGPACK_EXT_STRING_REF when that is shorter than writing
+// them again.
+static void
+string_table_intern(msgpack_object *mo, PackContext *ctx) {
+    uint32_t size = mo->via.raw.size;
+    uint32_t index;
+
+    if (ctx->strings == NULL || size < STRING_TABLE_MIN_LENGTH) {
+        return;
+    }
+
+    if (!ctx->strings->find_or_add(mo->via.raw.ptr, size, &index)) {
+        return;
+    }
+
+    uint32_t inline_size = size + ((size < 32) ? 1 : (size < 65536) ? 3 : 5);
+    uint32_t ref_size = (index < 256) ? 1 : (index < 65536) ? 2 : 4;
+
+    if (ref_size + 2 >= inline_size) {
+        ctx->strings->add_repeat();
+        return;
+    }
+
+    char *ptr = (char*) msgpack_zone_malloc(ctx->mz, ref_size);
+    switch (ref_size) {
+    case 1:
+        ptr[0] = static_cast<char>(index);
+        break;
+    case 2:
+        _msgpack_store16(ptr, static_cast<uint16_t>(index));
+        break;
+    default:
+        _msgpack_store32(ptr, index);
+    }
+
+    mo->type = MSGPACK_OBJECT_EXT;
+    mo->via.ext.type = MSGPACK_EXT_STRING_REF;
+    mo->via.ext.size = ref_size;
+    mo->via.ext.ptr = ptr;
+}
+
+// Take a msgpack_sbuffer from the pool, or allocate a new one.
+static msgpack_sbuffer *
+_alloc_sbuf() {
+    if (sbuffers.empty()) {
+        return msgpack_sbuffer_new();
+    }
+
+    msgpack_sbuffer *sb = sbuffers.top();
+    sbuffers.pop();
+    return sb;
+}
+
+// Return an sbuffer whose contents were not handed to a Buffer to the pool.
+static void
+_release_sbuf(msgpack_sbuffer *sb) {
+    sb->size = 0;
+    sbuffers.push(sb);
+}
+
+// Wrap the first length bytes of a SlowBuffer in a regular Buffer.
+static Local<Object>
+_fast_buffer(v8::Local<Buffer> slowBuffer, size_t length) {
+    // godsflaw: this part makes msgpack.pack() 1x slower than JSON.stringify()
+    // reaching back into JS appears to be expensive. The constructor is
+    // looked up once, in init(); packInto() avoids this altogether.
+    Handle<Value> cArgs[3] = {
+        slowBuffer->handle_,
+        v8::Integer::New(length),
+        v8::Integer::New(0)
+    };
+
+    return buffer_constructor->NewInstance(3, cArgs);
+}
+
+// Wrap the contents of an sbuffer in a Buffer. The sbuffer goes back to the
+// pool once the Buffer is garbage collected.
+static Local<Object>
+_sbuf_to_buffer(msgpack_sbuffer *sb) {
+    v8::Local<Buffer> slowBuffer = node::Buffer::New(
+        sb->data, sb->alloc, _free_sbuf, (void *)sb
+    );
+
+    return _fast_buffer(slowBuffer, sb->size);
+}
+
+// The number of bytes msgpack_pack_object() writes for mo itself, not
+// counting the items of an array or map.
+static size_t
+msgpack_object_packed_size(const msgpack_object *mo) {
+    switch (mo->type) {
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        return (mo->via.u64 < 128) ? 1 :
+            (mo->via.u64 < 256) ? 2 :
+            (mo->via.u64 < 65536) ? 3 :
+            (mo->via.u64 < 4294967296ULL) ? 5 : 9;
+
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        return (mo->via.i64 >= 0 && mo->via.i64 < 128) ? 1 :
+            (mo->via.i64 >= -32 && mo->via.i64 < 0) ? 1 :
+            (mo->via.i64 >= -128 && mo->via.i64 < 256) ? 2 :
+            (mo->via.i64 >= -32768 && mo->via.i64 < 65536) ? 3 :
+            (mo->via.i64 >= -2147483648LL &&
+             mo->via.i64 < 4294967296LL) ? 5 : 9;
+
+    case MSGPACK_OBJECT_DOUBLE:
+        return 9;
+
+    case MSGPACK_OBJECT_RAW:
+        return mo->via.raw.size + ((mo->via.raw.size < 32) ? 1 :
+            (mo->via.raw.size < 65536) ? 3 : 5);
+
+    case MSGPACK_OBJECT_EXT:
+        switch (mo->via.ext.size) {
+        case 1: case 2: case 4: case 8: case 16:
+            return mo->via.ext.size + 2;
+        default:
+            return mo->via.ext.size + ((mo->via.ext.size < 256) ? 3 :
+                (mo->via.ext.size < 65536) ? 4 : 6);
+        }
+
+    case MSGPACK_OBJECT_ARRAY:
+        return (mo->via.array.size < 16) ? 1 :
+            (mo->via.array.size < 65536) ? 3 : 5;
+
+    case MSGPACK_OBJECT_MAP:
+        return (mo->via.map.size < 16) ? 1 :
+            (mo->via.map.size < 65536) ? 3 : 5;
+
+    default:
+        return 1;
+    }
+}
+
+// With the maxBytes option, add mo to the running size of the output and
+// give up as soon as it is over the limit.
+static inline void
+pack_count_bytes(const msgpack_object *mo, PackContext *ctx) {
+    if (ctx->max_bytes == MAX_BYTES_UNLIMITED) {
+        return;
+    }
+
+    ctx->bytes += msgpack_object_packed_size(mo);
+    if (ctx->bytes > ctx->max_bytes) {
+        throw MsgpackException(
+            "Packed size exceeds maxBytes", Exception::RangeError);
+    }
+}
+
 // Convert a V8 object to a MessagePack object.
 //
 // This method is recursive. It will probably blow out the stack on objects
@@ -95,8 +460,9 @@ _free_sbuf(char *data, void *hint) {
 //
 // If a circular reference is detected, an exception is thrown.
 static void
-v8_to_msgpack(Handle<Value> v8obj, msgpack_object *mo, msgpack_zone *mz, size_t depth) {
+v8_to_msgpack(Handle<Value> v8obj, msgpack_object *mo, PackContext *ctx, size_t depth) {
     static const Persistent<String> TOJSON = NODE_PSYMBOL("toJSON");
+    msgpack_zone *mz = ctx->mz;
 
     if (512 < ++depth) {
         throw MsgpackException("Cowardly refusing to pack object with circular reference");
@@ -125,6 +491,7 @@ v8_to_msgpack(Handle<Value> v8obj, msgpack_object *mo, msgpack_zone *mz, size_t
         mo->via.raw.ptr = (char*) msgpack_zone_malloc(mz, mo->via.raw.size);
 
         DecodeWrite((char*) mo->via.raw.ptr, mo->via.raw.size, v8obj, UTF8);
+        string_table_intern(mo, ctx);
     } else if (v8obj->IsDate()) {
         mo->type = MSGPACK_OBJECT_RAW;
         Handle<Date> date = Handle<Date>::Cast(v8obj);
@@ -135,35 +502,52 @@ v8_to_msgpack(Handle<Value> v8obj, msgpack_object *mo, msgpack_zone *mz, size_t
         mo->via.raw.ptr = (char*) msgpack_zone_malloc(mz, mo->via.raw.size);
 
         DecodeWrite((char*) mo->via.raw.ptr, mo->via.raw.size, result, UTF8);
+        string_table_intern(mo, ctx);
     } else if (v8obj->IsArray()) {
         Local<Object> o = v8obj->ToObject();
         Local<Array> a = Local<Array>::Cast(o);
 
         mo->type = MSGPACK_OBJECT_ARRAY;
         mo->via.array.size = a->Length();
+        pack_count_bytes(mo, ctx);
         mo->via.array.ptr = (msgpack_object*) msgpack_zone_malloc(
             mz,
             sizeof(msgpack_object) * mo->via.array.size
         );
 
-        for (uint32_t i = 0; i < a->Length(); i++) {
-            Local<Value> v = a->Get(i);
-            v8_to_msgpack(v, &mo->via.array.ptr[i], mz, depth);
+        for (uint32_t b = 0; b < mo->via.array.size; b += HANDLE_SCOPE_BATCH) {
+            HandleScope scope;
+            uint32_t end = min(mo->via.array.size, b + HANDLE_SCOPE_BATCH);
+
+            for (uint32_t i = b; i < end; i++) {
+                Local<Value> v = a->Get(i);
+                v8_to_msgpack(v, &mo->via.array.ptr[i], ctx, depth);
+            }
         }
+
+        return;
     } else if (Buffer::HasInstance(v8obj)) {
         Local<Object> buf = v8obj->ToObject();
 
+        // A Buffer from toJSON() or a getter may have no other reference once
+        // the HandleScope around this item closes, and its data is not read
+        // until msgpack_pack_object()
+        if (ctx->buffers.IsEmpty()) {
+            ctx->buffers = Persistent<Array>::New(Array::New());
+        }
+        ctx->buffers->Set(ctx->buffer_count++, buf);
 
         mo->type = MSGPACK_OBJECT_RAW;
         mo->via.raw.size = static_cast<uint32_t>(Buffer::Length(buf));
         mo->via.raw.ptr = Buffer::Data(buf);
+        string_table_intern(mo, ctx);
     } else {
         Local<Object> o = v8obj->ToObject();
 
         // for o.toJSON()
         if (o->Has(TOJSON) && o->Get(TOJSON)->IsFunction()) {
             Local<Function> fn = Local<Function>::Cast(o->Get(TOJSON));
-            v8_to_msgpack(fn->Call(o, 0, NULL), mo, mz, depth);
+            v8_to_msgpack(fn->Call(o, 0, NULL), mo, ctx, depth);
             return;
         }
 
@@ -171,202 +555,3014 @@ v8_to_msgpack(Handle<Value> v8obj, msgpack_object *mo, msgpack_zone *mz, size_t
 
         mo->type = MSGPACK_OBJECT_MAP;
         mo->via.map.size = a->Length();
+        pack_count_bytes(mo, ctx);
         mo->via.map.ptr = (msgpack_object_kv*) msgpack_zone_malloc(
             mz,
             sizeof(msgpack_object_kv) * mo->via.map.size
         );
 
-        for (uint32_t i = 0; i < a->Length(); i++) {
-            Local<Value> k = a->Get(i);
+        for (uint32_t b = 0; b < mo->via.map.size; b += HANDLE_SCOPE_BATCH) {
+            HandleScope scope;
+            uint32_t end = min(mo->via.map.size, b + HANDLE_SCOPE_BATCH);
+
+            for (uint32_t i = b; i < end; i++) {
+                Local<Value> k = a->Get(i);
 
-            v8_to_msgpack(k, &mo->via.map.ptr[i].key, mz, depth);
-            v8_to_msgpack(o->Get(k), &mo->via.map.ptr[i].val, mz, depth);
+                v8_to_msgpack(k, &mo->via.map.ptr[i].key, ctx, depth);
+                v8_to_msgpack(o->Get(k), &mo->via.map.ptr[i].val, ctx, depth);
+            }
         }
+
+        return;
     }
-}
 
-// Convert a MessagePack object to a V8 object.
-//
-// This method is recursive. It will probably blow out the stack on objects
-// with extremely deep nesting.
-static Handle<Value>
-msgpack_to_v8(msgpack_object *mo) {
-    switch (mo->type) {
-    case MSGPACK_OBJECT_NIL:
-        return Null();
+    pack_count_bytes(mo, ctx);
+}
 
-    case MSGPACK_OBJECT_BOOLEAN:
-        return (mo->via.boolean) ?
-            True() :
-            False();
+// The bytes of an external string, copied out of the input so that they stay
+// put whatever becomes of it. V8 deletes the resource when the string is
+// collected; it is told about the memory so that it counts towards GC
+// pressure.
+class ExternalRaw : public String::ExternalAsciiStringResource {
+    public:
+        ExternalRaw(const char *ptr, size_t size) : size(size) {
+            bytes = new char[size];
+            memcpy(bytes, ptr, size);
+            V8::AdjustAmountOfExternalAllocatedMemory(size);
+        }
 
-    case MSGPACK_OBJECT_POSITIVE_INTEGER:
-        // As per Issue #42, we need to use the base Number
-        // class as opposed to the subclass Integer, since
-        // only the former takes 64-bit inputs. Using the
-        // Integer subclass will truncate 64-bit values.
-        return Number::New(static_cast<double>(mo->via.u64));
+        ~ExternalRaw() {
+            delete[] bytes;
+            V8::AdjustAmountOfExternalAllocatedMemory(
+                -static_cast<intptr_t>(size));
+        }
 
-    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
-        // See comment for MSGPACK_OBJECT_POSITIVE_INTEGER
-        return Number::New(static_cast<double>(mo->via.i64));
+        const char *data() const { return bytes; }
+        size_t length() const { return size; }
 
-    case MSGPACK_OBJECT_DOUBLE:
-        return Number::New(mo->via.dec);
+    private:
+        char *bytes;
+        size_t size;
+};
 
-    case MSGPACK_OBJECT_ARRAY: {
-        Local<Array> a = Array::New(mo->via.array.size);
+// Whether ptr holds only 7-bit bytes; checked a word at a time.
+static inline bool
+is_ascii(const char *ptr, size_t size) {
+    const uintptr_t high_bits = static_cast<uintptr_t>(-1) / 0xff * 0x80;
+    const char *end = ptr + size;
 
-        for (uint32_t i = 0; i < mo->via.array.size; i++) {
-            a->Set(i, msgpack_to_v8(&mo->via.array.ptr[i]));
+    for (; ptr < end && reinterpret_cast<uintptr_t>(ptr) % sizeof(uintptr_t);
+         ptr++) {
+        if (*ptr & 0x80) {
+            return false;
+        }
+    }
+    for (; ptr + sizeof(uintptr_t) <= end; ptr += sizeof(uintptr_t)) {
+        if (*reinterpret_cast<const uintptr_t *>(ptr) & high_bits) {
+            return false;
+        }
+    }
+    for (; ptr < end; ptr++) {
+        if (*ptr & 0x80) {
+            return false;
         }
+    }
 
-        return a;
+    return true;
+}
+
+// Convert a raw value to a V8 string.
+static Local<Value>
+raw_to_v8(const char *ptr, uint32_t size, UnpackContext *ctx) {
+    // Table entries are interned so that every reference to them
+    // resolves to the very same string
+    if (ctx->opts.string_table && size >= STRING_TABLE_MIN_LENGTH) {
+        Local<String> s = String::NewSymbol(ptr, size);
+        ctx->strings->Set(ctx->string_count++, s);
+        return s;
     }
 
-    case MSGPACK_OBJECT_RAW:
-        return String::New(mo->via.raw.ptr, mo->via.raw.size);
+    // Large ASCII values can live outside the V8 heap, where the collector
+    // never has to copy them
+    if (ctx->opts.external_strings && size >= EXTERNAL_STRING_MIN_LENGTH &&
+        is_ascii(ptr, size)) {
+        return String::NewExternal(new ExternalRaw(ptr, size));
+    }
 
-    case MSGPACK_OBJECT_MAP: {
-        Local<Object> o = Object::New();
+    // Everything else goes to String::New() without an ASCII check of our
+    // own: it scans the bytes a word at a time and builds a one-byte string
+    // directly when they are all ASCII, and only decodes UTF-8 otherwise.
+    // is_ascii() above is only needed to pick external strings.
+    return String::New(ptr, size);
+}
 
-        for (uint32_t i = 0; i < mo->via.map.size; i++) {
-            o->Set(
-                msgpack_to_v8(&mo->via.map.ptr[i].key),
-                msgpack_to_v8(&mo->via.map.ptr[i].val)
-            );
-        }
+// Strings made for map keys, kept across unpack() calls so that records which
+// all share the same keys do not each allocate their own copies. The cache is
+// direct-mapped on the length and the first and last bytes of the key, and
+// each slot keeps the bytes so that a hit is confirmed with memcmp().
+struct KeyCacheEntry {
+    Persistent<String> str;
+    uint32_t size;
+    char bytes[KEY_CACHE_MAX_LENGTH];
+};
 
-        return o;
+static KeyCacheEntry key_cache[KEY_CACHE_SIZE];
+
+// Return the raw value at off in the input as a Buffer sharing its memory.
+static Local<Value>
+raw_to_buffer(size_t off, uint32_t size, UnpackContext *ctx) {
+    Handle<Value> argv[2] = {
+        Number::New(static_cast<double>(off)),
+        Number::New(static_cast<double>(off + size))
+    };
+
+    Local<Value> b = ctx->slice->Call(ctx->buffer, 2, argv);
+    if (b.IsEmpty()) {
+        throw MsgpackException("Unable to slice the input Buffer",
+                               Exception::Error);
     }
 
-    default:
-        throw MsgpackException("Encountered unknown MesssagePack object type");
+    // Keep the string table numbering in step with the packer
+    if (ctx->opts.string_table && size >= STRING_TABLE_MIN_LENGTH) {
+        ctx->strings->Set(ctx->string_count++, b);
     }
+
+    return b;
 }
 
-// var buf = msgpack.pack(obj[, obj ...]);
-//
-// Returns a Buffer object representing the serialized state of the provided
-// JavaScript object. If more arguments are provided, their serialized state
-// will be accumulated to the end of the previous value(s).
-//
-// Any number of objects can be provided as arguments, and all will be
-// serialized to the same bytestream, back-to-back.
-static Handle<Value>
-pack(const Arguments &args) {
-    HandleScope scope;
+// Convert a raw map key to a V8 string, through the key cache. *slot is set
+// to the key's slot in the cache, or -1 if it is not cached.
+static Local<Value>
+raw_key_to_v8(const char *ptr, uint32_t size, UnpackContext *ctx, int *slot) {
+    *slot = -1;
 
-    msgpack_packer pk;
-    MsgpackZone mz;
-    msgpack_sbuffer *sb;
+    // Keys the string table needs to number go the usual way
+    if (size == 0 || size > KEY_CACHE_MAX_LENGTH ||
+        (ctx->opts.string_table && size >= STRING_TABLE_MIN_LENGTH)) {
+        return raw_to_v8(ptr, size, ctx);
+    }
 
-    if (!sbuffers.empty()) {
-        sb = sbuffers.top();
-        sbuffers.pop();
-    } else {
-        sb = msgpack_sbuffer_new();
+    uint32_t h = size;
+    h = h * 31 + static_cast<uint8_t>(ptr[0]);
+    h = h * 31 + static_cast<uint8_t>(ptr[size - 1]);
+    *slot = h & (KEY_CACHE_SIZE - 1);
+    KeyCacheEntry *e = &key_cache[*slot];
+
+    if (e->size == size && !memcmp(e->bytes, ptr, size)) {
+        return Local<String>::New(e->str);
     }
 
-    msgpack_packer_init(&pk, sb, msgpack_sbuffer_write);
+    Local<String> s = String::NewSymbol(ptr, size);
+    if (!e->str.IsEmpty()) {
+        e->str.Dispose();
+    }
+    e->str = Persistent<String>::New(s);
+    e->size = size;
+    memcpy(e->bytes, ptr, size);
 
-    for (int i = 0; i < args.Length(); i++) {
-        msgpack_object mo;
+    return s;
+}
 
-        try {
-            v8_to_msgpack(args[i], &mo, &mz._mz, 0);
-        } catch (MsgpackException e) {
-            return ThrowException(e.getThrownException());
-        }
+// Convert an ext value to a V8 object; only string table references are
+// understood.
+static Local<Value>
+ext_to_v8(int8_t type, const char *ptr, uint32_t size, UnpackContext *ctx) {
+    if (type != MSGPACK_EXT_STRING_REF) {
+        throw MsgpackException("Encountered unknown MessagePack ext type");
+    }
 
-        if (msgpack_pack_object(&pk, mo)) {
-            return ThrowException(Exception::Error(
-                String::New("Error serializaing object")));
-        }
+    if (!ctx->opts.string_table) {
+        throw MsgpackException("Encountered a string table reference; unpack with the stringTable option");
     }
 
-    v8::Local<Buffer> slowBuffer = node::Buffer::New(
-        sb->data, sb->alloc, _free_sbuf, (void *)sb
-    );
+    uint32_t index;
+    switch (size) {
+    case 1:
+        index = static_cast<uint8_t>(ptr[0]);
+        break;
+    case 2:
+        index = _msgpack_load16(uint16_t, ptr);
+        break;
+    case 4:
+        index = _msgpack_load32(uint32_t, ptr);
+        break;
+    default:
+        throw MsgpackException("Invalid string table reference");
+    }
 
-    // godsflaw: this part makes msgpack.pack() 1x slower than JSON.stringify()
-    // reaching back into JS appears to be expensive.
-    v8::Local<Object> global = v8::Context::GetCurrent()->Global();
-    v8::Local<Value> bv = global->Get(String::NewSymbol("Buffer"));
+    if (index >= ctx->string_count) {
+        throw MsgpackException("Invalid string table reference");
+    }
 
-    assert(bv->IsFunction());
+    return ctx->strings->Get(index);
+}
 
-    Local<Function> bc = v8::Local<Function>::Cast(bv);
-    Handle<Value> cArgs[3] = {
-        slowBuffer->handle_,
-        v8::Integer::New(sb->size),
-        v8::Integer::New(0)
-    };
-    v8::Local<Object> fastBuffer = bc->NewInstance(3, cArgs);
+// The maxLength and maxStringLength options; both are checked from the
+// header, before anything is allocated for the value.
+static inline void
+check_length(uint32_t n, UnpackContext *ctx) {
+    if (n > ctx->opts.max_length) {
+        throw MsgpackException("Array or map length exceeds maxLength",
+                               Exception::RangeError);
+    }
+}
+
+static inline void
+check_string_length(size_t size, UnpackContext *ctx) {
+    if (size > ctx->opts.max_string_length) {
+        throw MsgpackException("String length exceeds maxStringLength",
+                               Exception::RangeError);
+    }
+}
+
+// With the maps option, whether a map of n pairs is made an ES Map from the
+// outset; one with a key other than a string becomes one when that key is
+// met.
+static inline bool
+wants_map(uint32_t n, UnpackContext *ctx) {
+    return ctx->opts.maps && n >= ctx->opts.map_threshold;
+}
 
-    return scope.Close(fastBuffer);
+// A new, empty ES Map. Map is only there if node runs with --harmony.
+static Local<Object>
+new_map() {
+    if (map_constructor.IsEmpty()) {
+        throw MsgpackException("The maps option needs Map; run node with --harmony",
+                               Exception::Error);
+    }
+
+    Local<Object> m = map_constructor->NewInstance();
+    if (m.IsEmpty()) {
+        throw MsgpackException("Unable to create a Map", Exception::Error);
+    }
+
+    return m;
 }
 
-// var o = msgpack.unpack(buf);
+static inline void
+map_set(Handle<Value> m, Handle<Value> key, Handle<Value> value) {
+    Handle<Value> argv[2] = { key, value };
+    map_set_function->Call(Handle<Object>::Cast(m), 2, argv);
+}
+
+// The decoder used by unpack() is unpack_template.h instantiated with
+// callbacks that create V8 values directly, so the bytes are turned into
+// JavaScript objects in a single pass without building a msgpack_object
+// tree in a zone first.
 //
-// Return the JavaScript object resulting from unpacking the contents of the
-// specified buffer. If the buffer does not contain a complete object, the
-// undefined value is returned.
-static Handle<Value>
-unpack(const Arguments &args) {
-    static Persistent<String> msgpack_bytes_remaining_symbol =
-        NODE_PSYMBOL("bytes_remaining");
+// It is a state machine rather than a recursive walk, so deep nesting is
+// limited by the maxDepth option instead of the C stack. The state machine
+// keeps its own stack of open containers, which lives in the context for
+// the first MSGPACK_EMBED_STACK_SIZE levels and moves to the heap beyond.
+
+// A value under construction
+struct V8UnpackObject {
+    Local<Value> value;
+    Local<Array> keys;              // keys of a map; see shape_begin()
+    Local<Array> pairs;             // with the maps option, the keys and
+                                    // values of a map so far, if noted; see
+                                    // map_convert()
+    uint32_t index;                 // next slot of an array, or pair of a map
+    uint32_t count;                 // pairs in a map
+    int key_slot;                   // key cache slot of a map key, or -1
+    int shape_slot;                 // shape cache slot of a map, or -1
+    int shape;                      // SHAPE_NONE etc.; see shape_begin()
+    bool es_map;                    // whether a map is made an ES Map
+
+    V8UnpackObject() :
+        index(0), count(0), key_slot(-1), shape_slot(-1), shape(0),
+        es_map(false) {}
+};
 
-    HandleScope scope;
+struct V8UnpackUser {
+    UnpackContext *ctx;
+    size_t len;                     // size of the input
+    size_t items_left;              // input left for items not yet read
+    bool streaming;                 // whether more input may follow
+};
 
-    if (args.Length() < 0 || !Buffer::HasInstance(args[0])) {
-        return ThrowException(Exception::TypeError(
-            String::New("First argument must be a Buffer")));
+// Objects for maps are made from a cached shape when one fits: a boilerplate
+// object with the same keys added in the same order, whose copies start out
+// with their final layout, so that filling them in never has to add a
+// property. Shapes are cached by the number of pairs and the first key; the
+// first key of each map is checked against them before a copy is made, and
+// every other key as it arrives.
+//
+// A copy that turns out not to fit costs more than a plain object would have,
+// so each slot keeps a trust level that maps which fit raise and maps which
+// do not lower twice as fast; copies are only made while it is high, and
+// otherwise the keys are just compared. A map that does not fit replaces the
+// shape of its slot only once SHAPE_REPLACE_MISSES maps in a row have not
+// fitted it, so that two shapes which share a slot do not keep evicting each
+// other.
+#define SHAPE_BOILERPLATE 0
+#define SHAPE_KEYS 1
+
+#define SHAPE_NONE 0                // a plain object
+#define SHAPE_FOLLOW 1              // a copy of the boilerplate; keys checked
+#define SHAPE_MATCH 2               // a plain object; keys checked
+#define SHAPE_RECORD 3              // a plain object; keys noted to cache it
+
+#define SHAPE_TRUST_MAX 3
+#define SHAPE_TRUST_COPY 2          // least trust at which copies are made
+#define SHAPE_REPLACE_MISSES 4
+
+static Persistent<Array> shape_cache;
+static uint8_t shape_trust[SHAPE_CACHE_SIZE];
+static uint8_t shape_misses[SHAPE_CACHE_SIZE];
+
+// A map has fitted the shape in slot.
+static inline void
+shape_hit(int slot) {
+    shape_misses[slot] = 0;
+    if (shape_trust[slot] < SHAPE_TRUST_MAX) {
+        shape_trust[slot]++;
     }
+}
 
-    Local<Object> buf = args[0]->ToObject();
+// A map has not fitted the shape in slot. Returns whether the map should
+// replace it.
+static inline bool
+shape_miss(int slot) {
+    shape_trust[slot] = shape_trust[slot] > 2 ? shape_trust[slot] - 2 : 0;
+    if (shape_misses[slot] < SHAPE_REPLACE_MISSES) {
+        shape_misses[slot]++;
+    }
+    return shape_misses[slot] == SHAPE_REPLACE_MISSES;
+}
 
-    MsgpackZone mz;
-    msgpack_object mo;
-    size_t off = 0;
+// Make the object for the map c, given its first key k.
+static void
+shape_begin(V8UnpackObject *c, V8UnpackObject *k) {
+    c->shape = SHAPE_NONE;
+
+    if (k->key_slot >= 0 && c->count <= SHAPE_MAX_PAIRS) {
+        c->shape_slot = (k->key_slot * 31 + c->count) & (SHAPE_CACHE_SIZE - 1);
+
+        Local<Value> e = shape_cache->Get(c->shape_slot);
+        if (e->IsArray()) {
+            Local<Array> entry = Local<Array>::Cast(e);
+            Local<Array> keys = Local<Array>::Cast(entry->Get(SHAPE_KEYS));
+
+            if (keys->Length() == c->count &&
+                keys->Get(0)->StrictEquals(k->value)) {
+                c->keys = keys;
+                if (shape_trust[c->shape_slot] >= SHAPE_TRUST_COPY) {
+                    c->value = Local<Object>::Cast(
+                        entry->Get(SHAPE_BOILERPLATE)
+                    )->Clone();
+                    c->shape = SHAPE_FOLLOW;
+                    return;
+                }
+
+                c->shape = SHAPE_MATCH;
+                c->value = Object::New();
+                return;
+            }
+
+            if (!shape_miss(c->shape_slot)) {
+                c->value = Object::New();
+                return;
+            }
+        }
 
-    switch (msgpack_unpack(Buffer::Data(buf), Buffer::Length(buf), &off, &mz._mz, &mo)) {
-    case MSGPACK_UNPACK_EXTRA_BYTES:
-    case MSGPACK_UNPACK_SUCCESS:
-        try {
-            msgpack_unpack_template->GetFunction()->Set(
-                msgpack_bytes_remaining_symbol,
-                Integer::New(static_cast<int32_t>(Buffer::Length(buf) - off))
-            );
-            return scope.Close(msgpack_to_v8(&mo));
-        } catch (MsgpackException e) {
-            return ThrowException(e.getThrownException());
+        // Note the keys, to cache this shape once the map is complete
+        c->keys = Array::New(c->count);
+        c->shape = SHAPE_RECORD;
+    }
+
+    c->value = Object::New();
+}
+
+// The map c differs from its shape at pair c->index: move the pairs so far
+// to an object of its own if they are in a copy, and note its keys if it is
+// to replace the shape.
+static void
+shape_abandon(V8UnpackObject *c) {
+    Local<Array> keys;
+
+    if (shape_miss(c->shape_slot)) {
+        keys = Array::New(c->count);
+        for (uint32_t i = 0; i < c->index; i++) {
+            keys->Set(i, c->keys->Get(i));
         }
+    }
 
-    case MSGPACK_UNPACK_CONTINUE:
-        return scope.Close(Undefined());
+    if (c->shape == SHAPE_FOLLOW) {
+        Local<Object> from = Local<Object>::Cast(c->value);
+        Local<Object> to = Object::New();
 
-    default:
-        return ThrowException(Exception::Error(
-            String::New("Error de-serializing object")));
+        for (uint32_t i = 0; i < c->index; i++) {
+            Local<Value> key = c->keys->Get(i);
+            to->Set(key, from->Get(key));
+        }
+
+        c->value = to;
     }
+
+    c->keys = keys;
+    c->shape = keys.IsEmpty() ? SHAPE_NONE : SHAPE_RECORD;
 }
 
-extern "C" void
-init(Handle<Object> target) {
-    HandleScope scope;
+// With the maps option, whether the pair with key k would come back from the
+// object of a map in the order and with the value it went in. An array index
+// is moved ahead of the other keys and __proto__ sets the prototype instead.
+static inline bool
+map_key_keeps(Local<Value> k) {
+    static const Persistent<String> PROTO = NODE_PSYMBOL("__proto__");
+    return k->ToArrayIndex().IsEmpty() && !k->StrictEquals(PROTO);
+}
 
-    NODE_SET_METHOD(target, "pack", pack);
+// Start noting the pairs of the map c as they arrive, reading back the first
+// c->index of them from its object; every key so far keeps its order there.
+// Once a map has a shape, its keys so far are those in c->keys.
+static void
+map_note_pairs(V8UnpackObject *c) {
+    c->pairs = Array::New();
+    if (c->index == 0) {
+        return;
+    }
 
-    // Go through this mess rather than call NODE_SET_METHOD so that we can set
-    // a field on the function for 'bytes_remaining'.
-    msgpack_unpack_template = Persistent<FunctionTemplate>::New(
-        FunctionTemplate::New(unpack)
-    );
-    target->Set(
-        String::NewSymbol("unpack"),
-        msgpack_unpack_template->GetFunction()
-    );
+    Local<Object> o = Local<Object>::Cast(c->value);
+    Local<Array> keys = c->keys;
+    uint32_t n = c->index;
+    if (c->shape == SHAPE_NONE) {
+        keys = o->GetOwnPropertyNames();
+        n = keys->Length();
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        Local<Value> key = keys->Get(i);
+        c->pairs->Set(2 * i, key);
+        c->pairs->Set(2 * i + 1, o->Get(key));
+    }
+}
+
+// The map c has met a key that is not a string at pair c->index: move the
+// pairs so far to an ES Map. They are replayed as they arrived; they are read
+// back from the object only while that keeps their order and values, and are
+// noted from the first key that would not (see map_key_keeps()), so that
+// most maps never need a list of their own.
+static void
+map_convert(V8UnpackObject *c) {
+    Local<Object> m = new_map();
+
+    if (c->pairs.IsEmpty()) {
+        map_note_pairs(c);
+    }
+    for (uint32_t i = 0; i < c->pairs->Length(); i += 2) {
+        map_set(m, c->pairs->Get(i), c->pairs->Get(i + 1));
+    }
+
+    c->value = m;
+    c->keys = Local<Array>();
+    c->pairs = Local<Array>();
+    c->shape = SHAPE_NONE;
+    c->es_map = true;
+}
+
+// Cache the shape of the complete map c.
+static void
+shape_save(V8UnpackObject *c) {
+    Local<Object> boilerplate = Object::New();
+    for (uint32_t i = 0; i < c->count; i++) {
+        boilerplate->Set(c->keys->Get(i), Undefined());
+    }
+
+    Local<Array> entry = Array::New(2);
+    entry->Set(SHAPE_BOILERPLATE, boilerplate);
+    entry->Set(SHAPE_KEYS, c->keys);
+    shape_cache->Set(c->shape_slot, entry);
+    shape_trust[c->shape_slot] = SHAPE_TRUST_COPY;
+    shape_misses[c->shape_slot] = 0;
+}
+
+#define msgpack_unpack_struct(name) struct v8_template ## name
+#define msgpack_unpack_func(ret, name) static ret v8_template ## name
+#define msgpack_unpack_callback(name) v8_template_callback ## name
+#define msgpack_unpack_object V8UnpackObject
+#define msgpack_unpack_user V8UnpackUser
+
+static inline V8UnpackObject
+v8_template_callback_root(V8UnpackUser *u) {
+    return V8UnpackObject();
+}
+
+// Integers that fit in 32 bits are made with Integer, which V8 keeps as an
+// immediate small integer where it can rather than allocating a HeapNumber.
+// As per Issue #42, wider values need the base Number class, since the
+// Integer subclass would truncate them.
+static inline int
+v8_template_callback_uint8(V8UnpackUser *u, uint8_t d, V8UnpackObject *o) {
+    o->value = Integer::New(d);
+    return 0;
+}
+
+static inline int
+v8_template_callback_uint16(V8UnpackUser *u, uint16_t d, V8UnpackObject *o) {
+    o->value = Integer::New(d);
+    return 0;
+}
+
+static inline int
+v8_template_callback_uint32(V8UnpackUser *u, uint32_t d, V8UnpackObject *o) {
+    o->value = Integer::NewFromUnsigned(d);
+    return 0;
+}
+
+static inline int
+v8_template_callback_uint64(V8UnpackUser *u, uint64_t d, V8UnpackObject *o) {
+    if (static_cast<uint32_t>(d) == d) {
+        o->value = Integer::NewFromUnsigned(static_cast<uint32_t>(d));
+    } else {
+        o->value = Number::New(static_cast<double>(d));
+    }
+    return 0;
+}
+
+static inline int
+v8_template_callback_int8(V8UnpackUser *u, int8_t d, V8UnpackObject *o) {
+    o->value = Integer::New(d);
+    return 0;
+}
+
+static inline int
+v8_template_callback_int16(V8UnpackUser *u, int16_t d, V8UnpackObject *o) {
+    o->value = Integer::New(d);
+    return 0;
+}
+
+static inline int
+v8_template_callback_int32(V8UnpackUser *u, int32_t d, V8UnpackObject *o) {
+    o->value = Integer::New(d);
+    return 0;
+}
+
+static inline int
+v8_template_callback_int64(V8UnpackUser *u, int64_t d, V8UnpackObject *o) {
+    if (static_cast<int32_t>(d) == d) {
+        o->value = Integer::New(static_cast<int32_t>(d));
+    } else {
+        o->value = Number::New(static_cast<double>(d));
+    }
+    return 0;
+}
+
+static inline int
+v8_template_callback_float(V8UnpackUser *u, float d, V8UnpackObject *o) {
+    o->value = Number::New(d);
+    return 0;
+}
+
+static inline int
+v8_template_callback_double(V8UnpackUser *u, double d, V8UnpackObject *o) {
+    o->value = Number::New(d);
+    return 0;
+}
+
+static inline int
+v8_template_callback_nil(V8UnpackUser *u, V8UnpackObject *o) {
+    o->value = Local<Value>::New(Null());
+    return 0;
+}
+
+static inline int
+v8_template_callback_true(V8UnpackUser *u, V8UnpackObject *o) {
+    o->value = Local<Value>::New(True());
+    return 0;
+}
+
+static inline int
+v8_template_callback_false(V8UnpackUser *u, V8UnpackObject *o) {
+    o->value = Local<Value>::New(False());
+    return 0;
+}
+
+// Every item takes at least one byte, so the items that the open containers
+// still expect can never outnumber the input. Each count is taken from what
+// is left of it and given back an item at a time as they are read, so that
+// nested headers cannot each claim the whole input; a count that does not
+// fit is refused before V8 tries to allocate that much. When the rest of the
+// input is yet to come, space is only set aside for what is here.
+static inline int
+v8_template_callback_array(V8UnpackUser *u, unsigned int n, V8UnpackObject *o) {
+    check_length(n, u->ctx);
+    if (n > u->items_left && !u->streaming) {
+        return -1;
+    }
+    u->items_left -= n;
+
+    o->value = Array::New(min(static_cast<size_t>(n), u->len));
+    // The slot may last have held a map, whose key list must not be saved
+    // by v8_template_save() with this array
+    o->keys = Local<Array>();
+    o->pairs = Local<Array>();
+    o->index = 0;
+    return 0;
+}
+
+static inline int
+v8_template_callback_array_item(V8UnpackUser *u, V8UnpackObject *c, V8UnpackObject o) {
+    Local<Object>::Cast(c->value)->Set(c->index++, o.value);
+    u->items_left++;
+    return 0;
+}
+
+// The object for a map is made once its first key is known (an empty map
+// gets one straight away).
+static inline int
+v8_template_callback_map(V8UnpackUser *u, unsigned int n, V8UnpackObject *o) {
+    check_length(n, u->ctx);
+    if (n > u->items_left / 2 && !u->streaming) {
+        return -1;
+    }
+    u->items_left -= 2 * static_cast<size_t>(n);
+
+    o->es_map = wants_map(n, u->ctx);
+    if (o->es_map) {
+        o->value = new_map();
+    } else {
+        o->value = n ? Local<Value>() : Local<Value>(Object::New());
+    }
+    o->keys = Local<Array>();
+    o->pairs = Local<Array>();
+    o->index = 0;
+    o->count = n;
+    o->shape_slot = -1;
+    o->shape = SHAPE_NONE;
+    return 0;
+}
+
+static inline int
+v8_template_callback_map_item(V8UnpackUser *u, V8UnpackObject *c, V8UnpackObject k, V8UnpackObject v) {
+    u->items_left += 2;
+
+    if (!c->es_map && u->ctx->opts.maps && !k.value->IsString()) {
+        map_convert(c);
+    }
+
+    if (c->es_map) {
+        map_set(c->value, k.value, v.value);
+        c->index++;
+        return 0;
+    }
+
+    if (c->pairs.IsEmpty() && u->ctx->opts.maps && !map_key_keeps(k.value)) {
+        map_note_pairs(c);
+    }
+    if (!c->pairs.IsEmpty()) {
+        uint32_t i = c->pairs->Length();
+        c->pairs->Set(i, k.value);
+        c->pairs->Set(i + 1, v.value);
+    }
+
+    if (c->index == 0) {
+        shape_begin(c, &k);
+    } else if ((c->shape == SHAPE_FOLLOW || c->shape == SHAPE_MATCH) &&
+               !c->keys->Get(c->index)->StrictEquals(k.value)) {
+        shape_abandon(c);
+    }
+
+    if (c->shape == SHAPE_RECORD) {
+        c->keys->Set(c->index, k.value);
+    }
+
+    Local<Object>::Cast(c->value)->Set(k.value, v.value);
+
+    if (++c->index == c->count) {
+        if (c->shape == SHAPE_RECORD) {
+            shape_save(c);
+        } else if (c->shape != SHAPE_NONE) {
+            shape_hit(c->shape_slot);
+        }
+    }
+    return 0;
+}
+
+static inline int
+v8_template_callback_raw(V8UnpackUser *u, const char *b, const char *p, unsigned int l, V8UnpackObject *o) {
+    check_string_length(l, u->ctx);
+    o->value = u->ctx->opts.buffers ?
+        raw_to_buffer(p - b, l, u->ctx) :
+        raw_to_v8(p, l, u->ctx);
+    o->key_slot = -1;
+    return 0;
+}
+
+static inline int
+v8_template_callback_raw_key(V8UnpackUser *u, const char *b, const char *p, unsigned int l, V8UnpackObject *o) {
+    check_string_length(l, u->ctx);
+    o->value = raw_key_to_v8(p, l, u->ctx, &o->key_slot);
+    return 0;
+}
+
+static inline int
+v8_template_callback_ext(V8UnpackUser *u, const char *b, const char *p, unsigned int l, V8UnpackObject *o) {
+    o->value = ext_to_v8(*p, p + 1, l - 1, u->ctx);
+    return 0;
+}
+
+// Size of the number at p, or 0 if there is some other type of value there
+static inline size_t
+wire_number_size(const unsigned char *p) {
+    if (*p <= 0x7f || *p >= 0xe0) {
+        return 1;
+    }
+
+    switch (*p) {
+    case 0xcc: case 0xd0:
+        return 2;
+    case 0xcd: case 0xd1:
+        return 3;
+    case 0xca: case 0xce: case 0xd2:
+        return 5;
+    case 0xcb: case 0xcf: case 0xd3:
+        return 9;
+    default:
+        return 0;
+    }
+}
+
+// The number at p, which wire_number_size() has vouched for
+static inline double
+wire_number(const unsigned char *p) {
+    union { uint32_t i; float f; } mem32;
+    union { uint64_t i; double f; } mem64;
+
+    switch (*p) {
+    case 0xca:
+        mem32.i = _msgpack_load32(uint32_t, p + 1);
+        return mem32.f;
+    case 0xcb:
+        mem64.i = _msgpack_load64(uint64_t, p + 1);
+        return mem64.f;
+    case 0xcc:
+        return static_cast<uint8_t>(p[1]);
+    case 0xcd:
+        return _msgpack_load16(uint16_t, p + 1);
+    case 0xce:
+        return _msgpack_load32(uint32_t, p + 1);
+    case 0xcf:
+        return static_cast<double>(_msgpack_load64(uint64_t, p + 1));
+    case 0xd0:
+        return static_cast<int8_t>(p[1]);
+    case 0xd1:
+        return _msgpack_load16(int16_t, p + 1);
+    case 0xd2:
+        return _msgpack_load32(int32_t, p + 1);
+    case 0xd3:
+        return static_cast<double>(_msgpack_load64(int64_t, p + 1));
+    default:
+        return static_cast<int8_t>(*p);
+    }
+}
+
+// With the typedArrays option, an array of TYPED_ARRAY_MIN_LENGTH or more
+// numbers is decoded in one pass into an Int32Array if they are all 32-bit
+// integers, or a Float64Array otherwise. The numbers are checked first, so
+// anything else is left to be parsed item by item, as is a count that the
+// rest of the input cannot hold, which v8_template_callback_array() refuses.
+static inline int
+v8_template_callback_array_bulk(V8UnpackUser *u, unsigned int n, const char *p, size_t avail, size_t *used, V8UnpackObject *o) {
+    check_length(n, u->ctx);
+
+    if (!u->ctx->opts.typed_arrays || n < TYPED_ARRAY_MIN_LENGTH ||
+        (n > u->items_left && !u->streaming) ||
+        float64_array_constructor.IsEmpty()) {
+        return 0;
+    }
+
+    const unsigned char *start = (const unsigned char *) p;
+    const unsigned char *q = start;
+    const unsigned char *end = start + avail;
+    bool ints = true;
+
+    for (unsigned int i = 0; i < n; i++) {
+        size_t size = (q < end) ? wire_number_size(q) : 9;
+        if (size == 0) {
+            return 0;
+        }
+
+        // Ask for enough to hold the rest even if all are 64-bit
+        if (size > static_cast<size_t>(end - q)) {
+            *used = (q - start) + static_cast<size_t>(n - i) * 9;
+            return -1;
+        }
+
+        if (ints) {
+            double d = wire_number(q);
+            ints = *q != 0xca && *q != 0xcb &&
+                d >= -2147483648.0 && d <= 2147483647.0;
+        }
+        q += size;
+    }
+
+    Handle<Value> argv[1] = { Integer::NewFromUnsigned(n) };
+    Local<Object> a = (ints ? int32_array_constructor : float64_array_constructor)
+        ->NewInstance(1, argv);
+    if (a.IsEmpty()) {
+        throw MsgpackException("Unable to create a typed array",
+                               Exception::Error);
+    }
+
+    void *data = a->GetIndexedPropertiesExternalArrayData();
+    q = start;
+
+    for (unsigned int i = 0; i < n; i++) {
+        double d = wire_number(q);
+        if (ints) {
+            static_cast<int32_t *>(data)[i] = static_cast<int32_t>(d);
+        } else {
+            static_cast<double *>(data)[i] = d;
+        }
+        q += wire_number_size(q);
+    }
+
+    o->value = a;
+    *used = q - start;
+    return 1;
+}
+
+// V8UnpackObject has a constructor (and Local members), so the entries added
+// when the parser stack grows are constructed in place rather than zeroed
+#define msgpack_unpack_stack_init(s, n) \
+    for (size_t i_ = 0; i_ < (n); i_++) { new (&(s)[i_]) v8_template_stack(); }
+
+#define MSGPACK_UNPACK_ARRAY_BULK
+#define MSGPACK_UNPACK_RAW_KEY
+#include <msgpack/unpack_template.h>
+
+// Gather the containers that tc is still filling, with their pending map
+// keys, key lists and pair lists, into an array that can outlive the current
+// HandleScope. Handles that are not set yet are kept as undefined.
+static Local<Array>
+v8_template_save(v8_template_context *tc) {
+    Local<Array> a = Array::New(4 * tc->top);
+
+    for (unsigned int i = 0; i < tc->top; i++) {
+        v8_template_stack *s = &tc->stack[i];
+
+        if (!s->obj.value.IsEmpty()) {
+            a->Set(4 * i, s->obj.value);
+        }
+        if (!s->obj.keys.IsEmpty()) {
+            a->Set(4 * i + 1, s->obj.keys);
+        }
+        if (s->ct == CT_MAP_VALUE) {
+            a->Set(4 * i + 2, s->map_key.value);
+        }
+        if (!s->obj.pairs.IsEmpty()) {
+            a->Set(4 * i + 3, s->obj.pairs);
+        }
+    }
+
+    return a;
+}
+
+// Put back what v8_template_save() gathered.
+static void
+v8_template_restore(v8_template_context *tc, Local<Array> a) {
+    for (unsigned int i = 0; i < tc->top; i++) {
+        v8_template_stack *s = &tc->stack[i];
+        Local<Value> v;
+
+        v = a->Get(4 * i);
+        s->obj.value = v->IsUndefined() ? Local<Value>() : v;
+
+        v = a->Get(4 * i + 1);
+        s->obj.keys = v->IsUndefined() ?
+            Local<Array>() : Local<Array>::Cast(v);
+
+        if (s->ct == CT_MAP_VALUE) {
+            s->map_key.value = a->Get(4 * i + 2);
+        }
+
+        v = a->Get(4 * i + 3);
+        s->obj.pairs = v->IsUndefined() ?
+            Local<Array>() : Local<Array>::Cast(v);
+    }
+}
+
+// Run tc over data + *off up to len. Returns 1 once a value is complete and
+// sets *result, 0 if the input ends before the value does, or -1 if the
+// input is malformed; *off is left just past the bytes consumed. After a 0,
+// tc can be run again over more input.
+//
+// The input is fed to the state machine UNPACK_CHUNK bytes at a time, each
+// chunk in its own HandleScope. Between chunks only the containers still
+// being filled (and their pending map keys) are carried over, so the
+// handles used by a huge input are released as we go.
+static int
+v8_unpack_execute(v8_template_context *tc, const char *data, size_t len,
+                  size_t *off, Local<Value> *result) {
+    for (;;) {
+        // A raw value longer than a chunk is waited for in one piece
+        size_t end = *off + max(static_cast<size_t>(UNPACK_CHUNK),
+                                static_cast<size_t>(tc->trail));
+        end = min(end, len);
+
+        int ret;
+        Local<Array> live;
+        {
+            HandleScope scope;
+            ret = v8_template_execute(tc, data, end, off);
+
+            if (ret > 0) {
+                *result = scope.Close(v8_template_data(tc).value);
+            } else if (ret == 0) {
+                // Refuse an overlong raw value before waiting for all of it
+                if (tc->cs == ACS_RAW_VALUE) {
+                    check_string_length(tc->trail, tc->user.ctx);
+                }
+                live = scope.Close(v8_template_save(tc));
+            }
+        }
+
+        if (ret == 0) {
+            v8_template_restore(tc, live);
+        }
+
+        if (ret != 0 || end == len) {
+            return ret;
+        }
+    }
+}
+
+// Decode the value at data + *off into *result; returns the same as
+// v8_unpack_execute(). No more than the maxBytes option allows is read.
+static int
+v8_unpack(const char *data, size_t len, size_t *off,
+          UnpackContext *ctx, Local<Value> *result) {
+    size_t end = len;
+    if (ctx->opts.max_bytes < len - *off) {
+        end = *off + ctx->opts.max_bytes;
+    }
+
+    v8_template_context tc;
+    v8_template_init(&tc);
+    tc.max_depth = ctx->opts.max_depth;
+    tc.user.ctx = ctx;
+    tc.user.len = end;
+    tc.user.items_left = end - *off;
+    tc.user.streaming = false;
+
+    int ret;
+
+    try {
+        ret = v8_unpack_execute(&tc, data, end, off, result);
+        if (ret == 0 && end < len) {
+            throw MsgpackException("Unpacked size exceeds maxBytes",
+                                   Exception::RangeError);
+        }
+    } catch (MsgpackException e) {
+        v8_template_destroy(&tc);
+        throw;
+    }
+
+    v8_template_destroy(&tc);
+    return ret;
+}
+
+// A second instantiation of unpack_template.h that builds nothing at all; it
+// only finds where a value ends, so that the value can be stepped over
+// without being decoded. Along the way it counts the values it steps over
+// and how deep they nest, for validate().
+struct SkipObject {};
+struct SkipUser {
+    size_t count;                   // values seen, map keys included
+};
+
+#define msgpack_unpack_struct(name) struct skip_template ## name
+#define msgpack_unpack_func(ret, name) static ret skip_template ## name
+#define msgpack_unpack_callback(name) skip_template_callback ## name
+#define msgpack_unpack_object SkipObject
+#define msgpack_unpack_user SkipUser
+
+#define SKIP_CALLBACK(name, type) \
+    static inline int \
+    skip_template_callback ## name(SkipUser *u, type d, SkipObject *o) { \
+        ++u->count; \
+        return 0; \
+    }
+
+#define SKIP_CALLBACK_SIMPLE(name) \
+    static inline int \
+    skip_template_callback ## name(SkipUser *u, SkipObject *o) { \
+        ++u->count; \
+        return 0; \
+    }
+
+#define SKIP_CALLBACK_VARIABLE(name) \
+    static inline int \
+    skip_template_callback ## name(SkipUser *u, const char *b, const char *p, \
+                                   unsigned int l, SkipObject *o) { \
+        ++u->count; \
+        return 0; \
+    }
+
+static inline SkipObject
+skip_template_callback_root(SkipUser *u) {
+    return SkipObject();
+}
+
+SKIP_CALLBACK(_uint8, uint8_t)
+SKIP_CALLBACK(_uint16, uint16_t)
+SKIP_CALLBACK(_uint32, uint32_t)
+SKIP_CALLBACK(_uint64, uint64_t)
+SKIP_CALLBACK(_int8, int8_t)
+SKIP_CALLBACK(_int16, int16_t)
+SKIP_CALLBACK(_int32, int32_t)
+SKIP_CALLBACK(_int64, int64_t)
+SKIP_CALLBACK(_float, float)
+SKIP_CALLBACK(_double, double)
+SKIP_CALLBACK(_array, unsigned int)
+SKIP_CALLBACK(_map, unsigned int)
+SKIP_CALLBACK_SIMPLE(_nil)
+SKIP_CALLBACK_SIMPLE(_true)
+SKIP_CALLBACK_SIMPLE(_false)
+SKIP_CALLBACK_VARIABLE(_raw)
+SKIP_CALLBACK_VARIABLE(_ext)
+
+static inline int
+skip_template_callback_array_item(SkipUser *u, SkipObject *c, SkipObject o) {
+    return 0;
+}
+
+static inline int
+skip_template_callback_map_item(SkipUser *u, SkipObject *c, SkipObject k, SkipObject v) {
+    return 0;
+}
+
+#undef SKIP_CALLBACK
+#undef SKIP_CALLBACK_SIMPLE
+#undef SKIP_CALLBACK_VARIABLE
+
+#define MSGPACK_UNPACK_TRACK_DEPTH
+#include <msgpack/unpack_template.h>
+
+// Step over the value at data + *off. Returns 1 and moves *off past the
+// value, 0 if the input ends first, or -1 if the input is malformed.
+static int
+skip_value(const char *data, size_t len, size_t *off) {
+    skip_template_context tc;
+    skip_template_init(&tc);
+    tc.user.count = 0;
+
+    int ret = skip_template_execute(&tc, data, len, off);
+    skip_template_destroy(&tc);
+    return ret;
+}
+
+// Serialize args[first] onwards back-to-back and return them in a Buffer.
+static Handle<Value>
+pack_arguments(const Arguments &args, int first, PackContext *ctx) {
+    msgpack_packer pk;
+    msgpack_sbuffer *sb = _alloc_sbuf();
+
+    msgpack_packer_init(&pk, sb, msgpack_sbuffer_write);
+
+    for (int i = first; i < args.Length(); i++) {
+        msgpack_object mo;
+
+        try {
+            v8_to_msgpack(args[i], &mo, ctx, 0);
+        } catch (MsgpackException e) {
+            _release_sbuf(sb);
+            return ThrowException(e.getThrownException());
+        }
+
+        if (msgpack_pack_object(&pk, mo)) {
+            _release_sbuf(sb);
+            return ThrowException(Exception::Error(
+                String::New("Error serializaing object")));
+        }
+    }
+
+    return _sbuf_to_buffer(sb);
+}
+
+// var buf = msgpack.pack(obj[, obj ...]);
+//
+// Returns a Buffer object representing the serialized state of the provided
+// JavaScript object. If more arguments are provided, their serialized state
+// will be accumulated to the end of the previous value(s).
+//
+// Any number of objects can be provided as arguments, and all will be
+// serialized to the same bytestream, back-to-back.
+static Handle<Value>
+pack(const Arguments &args) {
+    HandleScope scope;
+
+    MsgpackZone mz;
+    if (!mz.ok) {
+        return ThrowException(Exception::Error(String::New("Out of memory")));
+    }
+    PackContext ctx(&mz._mz);
+
+    return scope.Close(pack_arguments(args, 0, &ctx));
+}
+
+// var buf = msgpack.packWithOptions(options, obj[, obj ...]);
+//
+// Like pack(), but takes an options object first:
+//
+//   stringTable: write repeated strings of 4 or more bytes as references to
+//                their first occurrence; unpack with the same option
+//   maxBytes:    throw a RangeError, without finishing, as soon as the
+//                output would be larger than this
+//
+//   zoneChunkSize: the size of the first chunk of memory for the objects
+//                being packed (1024 bytes by default, 8 MB at most); each
+//                chunk after it is twice as large
+static Handle<Value>
+packWithOptions(const Arguments &args) {
+    static Persistent<String> string_table_symbol =
+        NODE_PSYMBOL("stringTable");
+    static Persistent<String> max_bytes_symbol =
+        NODE_PSYMBOL("maxBytes");
+    static Persistent<String> zone_chunk_size_symbol =
+        NODE_PSYMBOL("zoneChunkSize");
+
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsObject()) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be an options object")));
+    }
+
+    Local<Object> opts = args[0]->ToObject();
+
+    size_t chunk_size = PACK_ZONE_CHUNK_SIZE;
+    Local<Value> zone_chunk_size = opts->Get(zone_chunk_size_symbol);
+    if (zone_chunk_size->IsNumber() && zone_chunk_size->NumberValue() >= 1) {
+        chunk_size = static_cast<size_t>(min(zone_chunk_size->NumberValue(),
+            static_cast<double>(MSGPACK_ZONE_CHUNK_SIZE_MAX)));
+    }
+
+    MsgpackZone mz(chunk_size);
+    if (!mz.ok) {
+        return ThrowException(Exception::Error(String::New("Out of memory")));
+    }
+    MsgpackStringTable strings;
+    PackContext ctx(&mz._mz);
+
+    if (opts->Get(string_table_symbol)->BooleanValue()) {
+        ctx.strings = &strings;
+    }
+
+    Local<Value> max_bytes = opts->Get(max_bytes_symbol);
+    if (max_bytes->IsNumber() && max_bytes->NumberValue() >= 0) {
+        ctx.max_bytes = static_cast<size_t>(max_bytes->NumberValue());
+    }
+
+    return scope.Close(pack_arguments(args, 1, &ctx));
+}
+
+// An encoder that packs values a bounded amount at a time, so that large
+// object graphs can be serialized without blocking the event loop.
+//
+// The traversal state lives in an explicit stack rather than on the C
+// stack: frames holds the position within each open array or map, while
+// the containers and map keys themselves are kept alive in the holders
+// array, at 2 * depth and 2 * depth + 1. Scalars go through v8_to_msgpack
+// and msgpack_pack_object just as in pack(), so the finished bytes are the
+// same.
+//
+// Values must not be modified until packing has finished.
+class IncrementalPacker : public ObjectWrap {
+    public:
+        static Persistent<FunctionTemplate> constructor_template;
+
+        static void Initialize(Handle<Object> target);
+
+    private:
+        struct Frame {
+            uint32_t index;
+            uint32_t length;
+            bool map;
+            bool value_next;    // the next map item is a value, not a key
+        };
+
+        IncrementalPacker() : sb(_alloc_sbuf()), done(false) {
+            msgpack_packer_init(&pk, sb, msgpack_sbuffer_write);
+        }
+
+        ~IncrementalPacker() {
+            if (sb != NULL) {
+                _release_sbuf(sb);
+            }
+            holders.Dispose();
+        }
+
+        void push(Handle<Object> container, Handle<Value> keys,
+                  uint32_t length, bool map);
+        void visit(Handle<Value> v, PackContext *ctx);
+        bool step(uint32_t max_nodes, double max_millis);
+
+        static Handle<Value> New(const Arguments &args);
+        static Handle<Value> Step(const Arguments &args);
+        static Handle<Value> GetBuffer(const Arguments &args);
+
+        Persistent<Array> holders;
+        vector<Frame> frames;
+        msgpack_packer pk;
+        msgpack_sbuffer *sb;
+        MsgpackZone mz;
+        bool done;
+};
+
+Persistent<FunctionTemplate> IncrementalPacker::constructor_template;
+
+void
+IncrementalPacker::push(Handle<Object> container, Handle<Value> keys,
+                        uint32_t length, bool map) {
+    if (frames.size() >= 512) {
+        throw MsgpackException("Cowardly refusing to pack object with circular reference");
+    }
+
+    uint32_t d = frames.size();
+    holders->Set(2 * d, container);
+    holders->Set(2 * d + 1, keys);
+
+    Frame f = { 0, length, map, false };
+    frames.push_back(f);
+}
+
+// Write the header of a container and open a frame for its items, or write
+// a scalar outright.
+void
+IncrementalPacker::visit(Handle<Value> v, PackContext *ctx) {
+    static const Persistent<String> TOJSON = NODE_PSYMBOL("toJSON");
+
+    if (v->IsArray()) {
+        Local<Array> a = Local<Array>::Cast(v->ToObject());
+
+        msgpack_pack_array(&pk, a->Length());
+        if (a->Length() > 0) {
+            push(a, Undefined(), a->Length(), false);
+        }
+    } else if (v->IsObject() && !v->IsDate() && !Buffer::HasInstance(v)) {
+        Local<Object> o = v->ToObject();
+
+        // for o.toJSON()
+        if (o->Has(TOJSON) && o->Get(TOJSON)->IsFunction()) {
+            Local<Function> fn = Local<Function>::Cast(o->Get(TOJSON));
+            visit(fn->Call(o, 0, NULL), ctx);
+            return;
+        }
+
+        Local<Array> keys = o->GetPropertyNames();
+
+        msgpack_pack_map(&pk, keys->Length());
+        if (keys->Length() > 0) {
+            push(o, keys, keys->Length(), true);
+        }
+    } else {
+        msgpack_object mo;
+
+        v8_to_msgpack(v, &mo, ctx, 0);
+        if (msgpack_pack_object(&pk, mo)) {
+            throw MsgpackException("Error serializaing object");
+        }
+    }
+}
+
+// Pack up to max_nodes values, or for about max_millis milliseconds,
+// whichever comes first. Returns true once everything has been packed.
+bool
+IncrementalPacker::step(uint32_t max_nodes, double max_millis) {
+    PackContext ctx(&mz._mz);
+    uint64_t deadline = uv_hrtime() + static_cast<uint64_t>(max_millis * 1e6);
+
+    for (uint32_t n = 0; !frames.empty() && n < max_nodes; n++) {
+        HandleScope scope;
+
+        if ((n & 0xff) == 0xff && uv_hrtime() >= deadline) {
+            break;
+        }
+
+        Frame &f = frames.back();
+        uint32_t d = frames.size() - 1;
+        Local<Object> container = holders->Get(2 * d)->ToObject();
+        Local<Value> v;
+
+        if (!f.map) {
+            v = container->Get(f.index++);
+        } else {
+            Local<Value> k = Local<Array>::Cast(
+                holders->Get(2 * d + 1)
+            )->Get(f.index);
+
+            if (f.value_next) {
+                v = container->Get(k);
+                f.index++;
+            } else {
+                v = k;
+            }
+            f.value_next = !f.value_next;
+        }
+
+        // Close every frame whose last item this was before visit() gets a
+        // chance to open a new one
+        while (!frames.empty() && frames.back().index == frames.back().length) {
+            frames.pop_back();
+            holders->Set(2 * frames.size(), Undefined());
+            holders->Set(2 * frames.size() + 1, Undefined());
+        }
+
+        visit(v, &ctx);
+    }
+
+    msgpack_zone_clear(&mz._mz);
+
+    done = frames.empty();
+    return done;
+}
+
+// new IncrementalPacker(obj[, obj ...])
+//
+// The values are packed back-to-back, as with pack().
+Handle<Value>
+IncrementalPacker::New(const Arguments &args) {
+    HandleScope scope;
+
+    IncrementalPacker *packer = new IncrementalPacker();
+    packer->Wrap(args.This());
+    if (!packer->mz.ok) {
+        return ThrowException(Exception::Error(String::New("Out of memory")));
+    }
+    packer->holders = Persistent<Array>::New(Array::New());
+
+    // The root frame holds the arguments themselves and has no header
+    if (args.Length() > 0) {
+        Local<Array> roots = Array::New(args.Length());
+        for (int i = 0; i < args.Length(); i++) {
+            roots->Set(i, args[i]);
+        }
+
+        packer->push(roots, Undefined(), args.Length(), false);
+    }
+
+    return args.This();
+}
+
+// var done = packer.step([maxNodes[, maxMillis]]);
+Handle<Value>
+IncrementalPacker::Step(const Arguments &args) {
+    HandleScope scope;
+
+    IncrementalPacker *packer =
+        ObjectWrap::Unwrap<IncrementalPacker>(args.This());
+
+    if (packer->sb == NULL) {
+        return ThrowException(Exception::Error(
+            String::New("Packer has already failed or finished")));
+    }
+
+    uint32_t max_nodes = (args.Length() > 0 && args[0]->IsNumber()) ?
+        args[0]->Uint32Value() : 0xffffffff;
+    double max_millis = (args.Length() > 1 && args[1]->IsNumber()) ?
+        args[1]->NumberValue() : 1e9;
+
+    try {
+        return scope.Close(Boolean::New(packer->step(max_nodes, max_millis)));
+    } catch (MsgpackException e) {
+        packer->frames.clear();
+        _release_sbuf(packer->sb);
+        packer->sb = NULL;
+        return ThrowException(e.getThrownException());
+    }
+}
+
+// var buf = packer.buffer();
+//
+// Returns the packed bytes once step() has returned true.
+Handle<Value>
+IncrementalPacker::GetBuffer(const Arguments &args) {
+    HandleScope scope;
+
+    IncrementalPacker *packer =
+        ObjectWrap::Unwrap<IncrementalPacker>(args.This());
+
+    if (!packer->done || packer->sb == NULL) {
+        return ThrowException(Exception::Error(
+            String::New("Packing has not finished")));
+    }
+
+    msgpack_sbuffer *sb = packer->sb;
+    packer->sb = NULL;
+
+    return scope.Close(_sbuf_to_buffer(sb));
+}
+
+void
+IncrementalPacker::Initialize(Handle<Object> target) {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+    constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+    constructor_template->SetClassName(String::NewSymbol("IncrementalPacker"));
+
+    NODE_SET_PROTOTYPE_METHOD(constructor_template, "step", Step);
+    NODE_SET_PROTOTYPE_METHOD(constructor_template, "buffer", GetBuffer);
+
+    target->Set(
+        String::NewSymbol("IncrementalPacker"),
+        constructor_template->GetFunction()
+    );
+}
+
+// A MessagePack array that can be appended to in place.
+//
+// The packed items follow a gap of PACKED_ARRAY_HEADER_ROOM bytes that the
+// array header is written into, right-aligned, so that going from a fixarray
+// to an array16 or array32 header only rewrites the header and never moves
+// the items. Appending is amortized O(1).
+#define PACKED_ARRAY_HEADER_ROOM 5
+
+class PackedArray : public ObjectWrap {
+    public:
+        static Persistent<FunctionTemplate> constructor_template;
+
+        static void Initialize(Handle<Object> target);
+
+    private:
+        PackedArray() : count(0), header_size(1) {
+            static const char room[PACKED_ARRAY_HEADER_ROOM] = {};
+
+            msgpack_sbuffer_init(&sb);
+            msgpack_packer_init(&pk, &sb, msgpack_sbuffer_write);
+            msgpack_sbuffer_write(&sb, room, PACKED_ARRAY_HEADER_ROOM);
+            write_header();
+        }
+
+        ~PackedArray() {
+            msgpack_sbuffer_destroy(&sb);
+        }
+
+        void write_header();
+
+        static Handle<Value> New(const Arguments &args);
+        static Handle<Value> Push(const Arguments &args);
+        static Handle<Value> PushPacked(const Arguments &args);
+        static Handle<Value> GetBuffer(const Arguments &args);
+
+        msgpack_sbuffer sb;
+        msgpack_packer pk;
+        uint32_t count;
+        size_t header_size;
+};
+
+Persistent<FunctionTemplate> PackedArray::constructor_template;
+
+// Write the header for the current count just in front of the items
+void
+PackedArray::write_header() {
+    char *end = sb.data + PACKED_ARRAY_HEADER_ROOM;
+
+    if (count < 16) {
+        header_size = 1;
+        end[-1] = static_cast<char>(0x90 | count);
+    } else if (count < 65536) {
+        header_size = 3;
+        end[-3] = static_cast<char>(0xdc);
+        _msgpack_store16(end - 2, static_cast<uint16_t>(count));
+    } else {
+        header_size = 5;
+        end[-5] = static_cast<char>(0xdd);
+        _msgpack_store32(end - 4, count);
+    }
+}
+
+// var a = new PackedArray([buf]);
+//
+// Starts from the packed array in buf, if given. Only its header is read;
+// the items are copied as they are.
+Handle<Value>
+PackedArray::New(const Arguments &args) {
+    HandleScope scope;
+
+    PackedArray *pa = new PackedArray();
+    pa->Wrap(args.This());
+
+    if (args.Length() < 1 || args[0]->IsUndefined()) {
+        return args.This();
+    }
+
+    if (!Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be a Buffer")));
+    }
+
+    Local<Object> buf = args[0]->ToObject();
+    const unsigned char *data = (const unsigned char *) Buffer::Data(buf);
+    size_t len = Buffer::Length(buf);
+    size_t header_size;
+    uint32_t count;
+
+    if (len >= 1 && (data[0] & 0xf0) == 0x90) {
+        header_size = 1;
+        count = data[0] & 0x0f;
+    } else if (len >= 3 && data[0] == 0xdc) {
+        header_size = 3;
+        count = _msgpack_load16(uint16_t, data + 1);
+    } else if (len >= 5 && data[0] == 0xdd) {
+        header_size = 5;
+        count = _msgpack_load32(uint32_t, data + 1);
+    } else {
+        return ThrowException(Exception::TypeError(
+            String::New("Buffer does not hold a packed array")));
+    }
+
+    msgpack_sbuffer_write(
+        &pa->sb, (const char *) data + header_size, len - header_size
+    );
+    pa->count = count;
+    pa->write_header();
+
+    return args.This();
+}
+
+// var length = a.push(obj[, obj ...]);
+//
+// Packs each value onto the end of the array and returns the new length.
+Handle<Value>
+PackedArray::Push(const Arguments &args) {
+    HandleScope scope;
+
+    PackedArray *pa = ObjectWrap::Unwrap<PackedArray>(args.This());
+    MsgpackZone mz;
+    if (!mz.ok) {
+        return ThrowException(Exception::Error(String::New("Out of memory")));
+    }
+    PackContext ctx(&mz._mz);
+
+    for (int i = 0; i < args.Length(); i++) {
+        msgpack_object mo;
+        size_t size = pa->sb.size;
+
+        try {
+            v8_to_msgpack(args[i], &mo, &ctx, 0);
+        } catch (MsgpackException e) {
+            pa->write_header();
+            return ThrowException(e.getThrownException());
+        }
+
+        if (msgpack_pack_object(&pa->pk, mo)) {
+            pa->sb.size = size;
+            pa->write_header();
+            return ThrowException(Exception::Error(
+                String::New("Error serializaing object")));
+        }
+
+        pa->count++;
+    }
+
+    pa->write_header();
+
+    return scope.Close(Integer::NewFromUnsigned(pa->count));
+}
+
+// var length = a.pushPacked(buf[, count]);
+//
+// Appends items that are already packed: buf must hold count (by default
+// one) complete MessagePack objects, which are copied without being checked.
+Handle<Value>
+PackedArray::PushPacked(const Arguments &args) {
+    HandleScope scope;
+
+    PackedArray *pa = ObjectWrap::Unwrap<PackedArray>(args.This());
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be a Buffer")));
+    }
+
+    Local<Object> buf = args[0]->ToObject();
+    uint32_t n = (args.Length() > 1) ? args[1]->Uint32Value() : 1;
+
+    msgpack_sbuffer_write(&pa->sb, Buffer::Data(buf), Buffer::Length(buf));
+    pa->count += n;
+    pa->write_header();
+
+    return scope.Close(Integer::NewFromUnsigned(pa->count));
+}
+
+// var buf = a.buffer();
+//
+// Returns a copy of the packed array.
+Handle<Value>
+PackedArray::GetBuffer(const Arguments &args) {
+    HandleScope scope;
+
+    PackedArray *pa = ObjectWrap::Unwrap<PackedArray>(args.This());
+    size_t start = PACKED_ARRAY_HEADER_ROOM - pa->header_size;
+    size_t length = pa->sb.size - start;
+
+    Buffer *slowBuffer = Buffer::New(pa->sb.data + start, length);
+
+    return scope.Close(_fast_buffer(slowBuffer, length));
+}
+
+void
+PackedArray::Initialize(Handle<Object> target) {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+    constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+    constructor_template->SetClassName(String::NewSymbol("PackedArray"));
+
+    NODE_SET_PROTOTYPE_METHOD(constructor_template, "push", Push);
+    NODE_SET_PROTOTYPE_METHOD(constructor_template, "pushPacked", PushPacked);
+    NODE_SET_PROTOTYPE_METHOD(constructor_template, "buffer", GetBuffer);
+
+    target->Set(
+        String::NewSymbol("PackedArray"),
+        constructor_template->GetFunction()
+    );
+}
+
+// A fixed-size output area for msgpack_packer, used by packInto()
+struct FixedBuffer {
+    char *data;
+    size_t size;
+    size_t used;
+};
+
+static int
+_fixed_buffer_write(void *data, const char *buf, unsigned int len) {
+    FixedBuffer *fb = (FixedBuffer *) data;
+
+    if (fb->size - fb->used < len) {
+        return -1;
+    }
+
+    memcpy(fb->data + fb->used, buf, len);
+    fb->used += len;
+    return 0;
+}
+
+// var n = msgpack.packInto(buf, offset, obj[, obj ...]);
+//
+// Packs the values back-to-back into buf starting at offset and returns the
+// number of bytes written. Throws a RangeError if they do not fit, in which
+// case the contents of buf after offset are unspecified.
+//
+// This skips allocating the output and creating a Buffer for it, which is
+// most of the cost of packing a small value with pack().
+static Handle<Value>
+packInto(const Arguments &args) {
+    HandleScope scope;
+
+    if (args.Length() < 2 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be a Buffer")));
+    }
+
+    Local<Object> buf = args[0]->ToObject();
+    size_t offset = args[1]->Uint32Value();
+
+    if (offset > Buffer::Length(buf)) {
+        return ThrowException(Exception::RangeError(
+            String::New("Offset is out of bounds")));
+    }
+
+    FixedBuffer fb = { Buffer::Data(buf) + offset,
+                       Buffer::Length(buf) - offset, 0 };
+    msgpack_packer pk;
+    msgpack_packer_init(&pk, &fb, _fixed_buffer_write);
+
+    MsgpackZone mz;
+    if (!mz.ok) {
+        return ThrowException(Exception::Error(String::New("Out of memory")));
+    }
+    PackContext ctx(&mz._mz);
+
+    for (int i = 2; i < args.Length(); i++) {
+        msgpack_object mo;
+
+        try {
+            v8_to_msgpack(args[i], &mo, &ctx, 0);
+        } catch (MsgpackException e) {
+            return ThrowException(e.getThrownException());
+        }
+
+        if (msgpack_pack_object(&pk, mo)) {
+            return ThrowException(Exception::RangeError(
+                String::New("Buffer is too small")));
+        }
+    }
+
+    return scope.Close(Integer::NewFromUnsigned(fb.used));
+}
+
+// Read the options object given to unpack(), if any.
+static void
+parse_unpack_options(Handle<Value> v, UnpackOptions *opts) {
+    static Persistent<String> string_table_symbol =
+        NODE_PSYMBOL("stringTable");
+    static Persistent<String> buffers_symbol =
+        NODE_PSYMBOL("buffers");
+    static Persistent<String> typed_arrays_symbol =
+        NODE_PSYMBOL("typedArrays");
+    static Persistent<String> max_depth_symbol =
+        NODE_PSYMBOL("maxDepth");
+    static Persistent<String> max_length_symbol =
+        NODE_PSYMBOL("maxLength");
+    static Persistent<String> max_string_length_symbol =
+        NODE_PSYMBOL("maxStringLength");
+    static Persistent<String> max_bytes_symbol =
+        NODE_PSYMBOL("maxBytes");
+    static Persistent<String> zone_chunk_size_symbol =
+        NODE_PSYMBOL("zoneChunkSize");
+    static Persistent<String> external_strings_symbol =
+        NODE_PSYMBOL("externalStrings");
+    static Persistent<String> maps_symbol =
+        NODE_PSYMBOL("maps");
+
+    if (!v->IsObject()) {
+        return;
+    }
+
+    Local<Object> o = v->ToObject();
+    opts->string_table = o->Get(string_table_symbol)->BooleanValue();
+    opts->buffers = o->Get(buffers_symbol)->BooleanValue();
+    opts->typed_arrays = o->Get(typed_arrays_symbol)->BooleanValue();
+    opts->external_strings =
+        o->Get(external_strings_symbol)->BooleanValue();
+
+    Local<Value> maps = o->Get(maps_symbol);
+    opts->maps = maps->BooleanValue() ||
+        (maps->IsNumber() && maps->NumberValue() == 0);
+    if (maps->IsNumber()) {
+        opts->map_threshold = maps->Uint32Value();
+    }
+
+    Local<Value> max_depth = o->Get(max_depth_symbol);
+    if (max_depth->IsNumber() && max_depth->NumberValue() >= 1) {
+        opts->max_depth = max_depth->Uint32Value();
+    }
+
+    Local<Value> max_length = o->Get(max_length_symbol);
+    if (max_length->IsNumber() && max_length->NumberValue() >= 0) {
+        opts->max_length = max_length->Uint32Value();
+    }
+
+    Local<Value> max_string_length = o->Get(max_string_length_symbol);
+    if (max_string_length->IsNumber() &&
+        max_string_length->NumberValue() >= 0) {
+        opts->max_string_length = max_string_length->Uint32Value();
+    }
+
+    Local<Value> max_bytes = o->Get(max_bytes_symbol);
+    if (max_bytes->IsNumber() && max_bytes->NumberValue() >= 0) {
+        opts->max_bytes = static_cast<size_t>(max_bytes->NumberValue());
+    }
+
+    Local<Value> zone_chunk_size = o->Get(zone_chunk_size_symbol);
+    if (zone_chunk_size->IsNumber() && zone_chunk_size->NumberValue() >= 1) {
+        opts->zone_chunk_size = static_cast<size_t>(min(
+            zone_chunk_size->NumberValue(),
+            static_cast<double>(MSGPACK_ZONE_CHUNK_SIZE_MAX)));
+    }
+}
+
+// Prepare ctx for unpacking buf with the given options object, if any.
+static void
+init_unpack_context(Local<Object> buf, Handle<Value> options,
+                    UnpackContext *ctx) {
+    static Persistent<String> slice_symbol = NODE_PSYMBOL("slice");
+
+    parse_unpack_options(options, &ctx->opts);
+
+    if (ctx->opts.string_table) {
+        ctx->strings = Array::New();
+    }
+    if (ctx->opts.buffers) {
+        ctx->buffer = buf;
+        ctx->slice = Local<Function>::Cast(buf->Get(slice_symbol));
+    }
+}
+
+// var o = msgpack.unpack(buf[, offset][, options]);
+//
+// Return the JavaScript object resulting from unpacking the contents of the
+// specified buffer, starting offset bytes in. If the buffer does not contain
+// a complete object, the undefined value is returned.
+//
+// Options:
+//
+//   stringTable: resolve the string references written by
+//                packWithOptions({stringTable: true}, ...)
+//
+//   buffers:     return raw values other than map keys as Buffers that
+//                share the memory of buf, rather than as strings
+//
+//   maxDepth:    fail on containers nested deeper than this (512 by
+//                default, the same limit that pack() has)
+//
+//   externalStrings: keep ASCII raw values of 1024 or more bytes out of the
+//                V8 heap, in copies that are freed with the strings
+//
+//   maps:        make maps ES Map objects instead, keeping keys of any
+//                type; true for every map, or a number for maps of at
+//                least that many pairs and maps with keys that are not
+//                strings
+//
+//   maxLength, maxStringLength, maxBytes:
+//                throw a RangeError on an array or map with more items, a
+//                raw value with more bytes, or an object that takes more
+//                bytes than this; the lengths are checked from the header,
+//                before anything is allocated
+static Handle<Value>
+unpack(const Arguments &args) {
+    static Persistent<String> msgpack_bytes_remaining_symbol =
+        NODE_PSYMBOL("bytes_remaining");
+
+    HandleScope scope;
+
+    if (args.Length() < 0 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be a Buffer")));
+    }
+
+    Local<Object> buf = args[0]->ToObject();
+    int next = 1;
+    size_t off = 0;
+
+    if (args.Length() > 1 && args[1]->IsNumber()) {
+        off = args[1]->Uint32Value();
+        next = 2;
+
+        if (off > Buffer::Length(buf)) {
+            return ThrowException(Exception::RangeError(
+                String::New("Offset is out of bounds")));
+        }
+    }
+
+    UnpackContext ctx;
+    init_unpack_context(buf, args[next], &ctx);
+
+    Local<Value> result;
+    int ret;
+
+    try {
+        ret = v8_unpack(Buffer::Data(buf), Buffer::Length(buf), &off,
+                        &ctx, &result);
+    } catch (MsgpackException e) {
+        return ThrowException(e.getThrownException());
+    }
+
+    if (ret == 0) {
+        return scope.Close(Undefined());
+    }
+
+    if (ret < 0) {
+        return ThrowException(Exception::Error(
+            String::New("Error de-serializing object")));
+    }
+
+    msgpack_unpack_function->Set(
+        msgpack_bytes_remaining_symbol,
+        Integer::New(static_cast<int32_t>(Buffer::Length(buf) - off))
+    );
+
+    return scope.Close(result);
+}
+
+// var r = msgpack.unpackAt(buf, offset[, result[, options]]);
+//
+// Unpack the object that starts offset bytes into buf, and return an object
+// with its value and the offset just past it:
+//
+//   {value: ..., offset: ...}
+//
+// If a result object is given, these are set on it and it is returned
+// instead (pass null to give options without one), so a Buffer can be walked
+// without allocating anything but the values:
+//
+//   var r = {};
+//   for (var off = 0; msgpack.unpackAt(buf, off, r); off = r.offset) { ... }
+//
+// Undefined is returned if buf does not contain a complete object. Unlike
+// unpack(), this does not set unpack.bytes_remaining. The options are those
+// of unpack().
+static Handle<Value>
+unpackAt(const Arguments &args) {
+    static Persistent<String> value_symbol = NODE_PSYMBOL("value");
+    static Persistent<String> offset_symbol = NODE_PSYMBOL("offset");
+
+    HandleScope scope;
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be a Buffer")));
+    }
+
+    Local<Object> buf = args[0]->ToObject();
+    size_t len = Buffer::Length(buf);
+    size_t off = args[1]->Uint32Value();
+
+    if (off > len) {
+        return ThrowException(Exception::RangeError(
+            String::New("Offset is out of bounds")));
+    }
+
+    Local<Object> r;
+    if (args[2]->IsObject()) {
+        r = args[2]->ToObject();
+    }
+
+    UnpackContext ctx;
+    init_unpack_context(buf, args[3], &ctx);
+
+    Local<Value> result;
+    int ret;
+
+    try {
+        ret = v8_unpack(Buffer::Data(buf), len, &off, &ctx, &result);
+    } catch (MsgpackException e) {
+        return ThrowException(e.getThrownException());
+    }
+
+    if (ret == 0) {
+        return scope.Close(Undefined());
+    }
+
+    if (ret < 0) {
+        return ThrowException(Exception::Error(
+            String::New("Error de-serializing object")));
+    }
+
+    if (r.IsEmpty()) {
+        r = Object::New();
+    }
+    r->Set(value_symbol, result);
+    r->Set(offset_symbol, Number::New(static_cast<double>(off)));
+
+    return scope.Close(r);
+}
+
+// var a = msgpack.unpackAll(buf[, options]);
+//
+// Unpack every object packed back-to-back in buf, such as the output of
+// pack(a, b, c), and return them in an array. If buf ends with an incomplete
+// object, its size is given by the bytes_remaining property of the array.
+// The options are those of unpack().
+static Handle<Value>
+unpackAll(const Arguments &args) {
+    static Persistent<String> bytes_remaining_symbol =
+        NODE_PSYMBOL("bytes_remaining");
+
+    HandleScope scope;
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be a Buffer")));
+    }
+
+    Local<Object> buf = args[0]->ToObject();
+    const char *data = Buffer::Data(buf);
+    size_t len = Buffer::Length(buf);
+    size_t off = 0;
+
+    UnpackContext ctx;
+    init_unpack_context(buf, args[1], &ctx);
+
+    Local<Array> values = Array::New();
+    uint32_t count = 0;
+
+    try {
+        while (off < len) {
+            HandleScope item_scope;
+            Local<Value> result;
+            size_t start = off;
+
+            int ret = v8_unpack(data, len, &off, &ctx, &result);
+            if (ret == 0) {
+                off = start;
+                break;
+            }
+
+            if (ret < 0) {
+                return ThrowException(Exception::Error(
+                    String::New("Error de-serializing object")));
+            }
+
+            values->Set(count++, result);
+        }
+    } catch (MsgpackException e) {
+        return ThrowException(e.getThrownException());
+    }
+
+    values->Set(bytes_remaining_symbol,
+                Integer::New(static_cast<int32_t>(len - off)));
+
+    return scope.Close(values);
+}
+
+// unpackAsync() parses on the thread pool into a msgpack_object tree in a
+// zone, and only turns that tree into V8 values back on the main thread.
+// The conversion recurses, but the parser has already refused anything
+// nested deeper than MSGPACK_MAX_DEPTH.
+
+// The number in mo, which must be an integer or a double
+static inline double
+msgpack_number(msgpack_object *mo) {
+    switch (mo->type) {
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        return static_cast<double>(mo->via.u64);
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        return static_cast<double>(mo->via.i64);
+    default:
+        return mo->via.dec;
+    }
+}
+
+// The typed array that the typedArrays option makes of a, or an empty handle
+// if a holds anything other than numbers.
+static Local<Value>
+msgpack_array_to_typed(msgpack_object_array *a) {
+    bool ints = true;
+
+    for (uint32_t i = 0; i < a->size; i++) {
+        msgpack_object *e = &a->ptr[i];
+
+        switch (e->type) {
+        case MSGPACK_OBJECT_POSITIVE_INTEGER:
+            ints = ints && e->via.u64 <= 2147483647U;
+            break;
+        case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+            ints = ints && e->via.i64 >= -2147483647LL - 1;
+            break;
+        case MSGPACK_OBJECT_DOUBLE:
+            ints = false;
+            break;
+        default:
+            return Local<Value>();
+        }
+    }
+
+    Handle<Value> argv[1] = { Integer::NewFromUnsigned(a->size) };
+    Local<Object> t = (ints ? int32_array_constructor : float64_array_constructor)
+        ->NewInstance(1, argv);
+    if (t.IsEmpty()) {
+        throw MsgpackException("Unable to create a typed array",
+                               Exception::Error);
+    }
+
+    void *data = t->GetIndexedPropertiesExternalArrayData();
+    for (uint32_t i = 0; i < a->size; i++) {
+        double d = msgpack_number(&a->ptr[i]);
+        if (ints) {
+            static_cast<int32_t *>(data)[i] = static_cast<int32_t>(d);
+        } else {
+            static_cast<double *>(data)[i] = d;
+        }
+    }
+
+    return t;
+}
+
+// Convert mo to a V8 value the same way that unpack() would. Raw map keys go
+// through the key cache.
+static Local<Value>
+msgpack_to_v8(msgpack_object *mo, UnpackContext *ctx, bool key = false) {
+    switch (mo->type) {
+    case MSGPACK_OBJECT_NIL:
+        return Local<Value>::New(Null());
+
+    case MSGPACK_OBJECT_BOOLEAN:
+        return Local<Value>::New(mo->via.boolean ? True() : False());
+
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        if (static_cast<uint32_t>(mo->via.u64) == mo->via.u64) {
+            return Integer::NewFromUnsigned(static_cast<uint32_t>(mo->via.u64));
+        }
+        return Number::New(static_cast<double>(mo->via.u64));
+
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        if (static_cast<int32_t>(mo->via.i64) == mo->via.i64) {
+            return Integer::New(static_cast<int32_t>(mo->via.i64));
+        }
+        return Number::New(static_cast<double>(mo->via.i64));
+
+    case MSGPACK_OBJECT_DOUBLE:
+        return Number::New(mo->via.dec);
+
+    case MSGPACK_OBJECT_RAW:
+        check_string_length(mo->via.raw.size, ctx);
+        if (key) {
+            int slot;
+            return raw_key_to_v8(mo->via.raw.ptr, mo->via.raw.size, ctx, &slot);
+        }
+        if (ctx->opts.buffers) {
+            return raw_to_buffer(mo->via.raw.ptr - Buffer::Data(ctx->buffer),
+                                 mo->via.raw.size, ctx);
+        }
+        return raw_to_v8(mo->via.raw.ptr, mo->via.raw.size, ctx);
+
+    case MSGPACK_OBJECT_EXT:
+        return ext_to_v8(mo->via.ext.type, mo->via.ext.ptr, mo->via.ext.size,
+                         ctx);
+
+    case MSGPACK_OBJECT_ARRAY: {
+        check_length(mo->via.array.size, ctx);
+        if (ctx->opts.typed_arrays &&
+            mo->via.array.size >= TYPED_ARRAY_MIN_LENGTH &&
+            !float64_array_constructor.IsEmpty()) {
+            Local<Value> t = msgpack_array_to_typed(&mo->via.array);
+            if (!t.IsEmpty()) {
+                return t;
+            }
+        }
+
+        Local<Array> a = Array::New(mo->via.array.size);
+
+        for (uint32_t b = 0; b < mo->via.array.size; b += HANDLE_SCOPE_BATCH) {
+            HandleScope scope;
+            uint32_t end = min(mo->via.array.size, b + HANDLE_SCOPE_BATCH);
+
+            for (uint32_t i = b; i < end; i++) {
+                a->Set(i, msgpack_to_v8(&mo->via.array.ptr[i], ctx));
+            }
+        }
+
+        return a;
+    }
+
+    case MSGPACK_OBJECT_MAP: {
+        check_length(mo->via.map.size, ctx);
+
+        // String table references unpack to strings, like raw keys
+        bool es_map = wants_map(mo->via.map.size, ctx);
+        for (uint32_t i = 0; ctx->opts.maps && !es_map &&
+             i < mo->via.map.size; i++) {
+            msgpack_object *k = &mo->via.map.ptr[i].key;
+            es_map = k->type != MSGPACK_OBJECT_RAW &&
+                !(k->type == MSGPACK_OBJECT_EXT &&
+                  k->via.ext.type == MSGPACK_EXT_STRING_REF);
+        }
+
+        if (es_map) {
+            Local<Object> m = new_map();
+
+            for (uint32_t i = 0; i < mo->via.map.size; i++) {
+                HandleScope scope;
+                Local<Value> k =
+                    msgpack_to_v8(&mo->via.map.ptr[i].key, ctx, true);
+                map_set(m, k, msgpack_to_v8(&mo->via.map.ptr[i].val, ctx));
+            }
+
+            return m;
+        }
+
+        Local<Object> o = Object::New();
+
+        for (uint32_t b = 0; b < mo->via.map.size; b += HANDLE_SCOPE_BATCH) {
+            HandleScope scope;
+            uint32_t end = min(mo->via.map.size, b + HANDLE_SCOPE_BATCH);
+
+            for (uint32_t i = b; i < end; i++) {
+                // The key comes first, so that both number their strings
+                // in the string table in the order they were packed
+                Local<Value> k =
+                    msgpack_to_v8(&mo->via.map.ptr[i].key, ctx, true);
+                o->Set(k, msgpack_to_v8(&mo->via.map.ptr[i].val, ctx));
+            }
+        }
+
+        return o;
+    }
+
+    default:
+        throw MsgpackException("Encountered unknown MesssagePack object type");
+    }
+}
+
+// An unpackAsync() call in progress. The input Buffer is held on to so that
+// its memory stays put while the thread pool reads it.
+struct UnpackWork {
+    uv_work_t req;
+    Persistent<Object> buffer;
+    Persistent<Value> options;
+    Persistent<Function> callback;
+    const char *data;
+    size_t len;                     // no more than maxBytes
+    bool truncated;                 // whether maxBytes cut the input short
+    msgpack_zone zone;
+    msgpack_object object;
+    msgpack_unpack_return ret;
+};
+
+// Runs on the thread pool; must not touch V8
+static void
+unpack_async_work(uv_work_t *req) {
+    UnpackWork *w = static_cast<UnpackWork *>(req->data);
+    size_t off = 0;
+
+    w->ret = msgpack_unpack(w->data, w->len, &off, &w->zone, &w->object);
+}
+
+// Back on the main thread: convert the result and call back
+#if NODE_VERSION_AT_LEAST(0, 9, 4)
+static void
+unpack_async_after(uv_work_t *req, int status) {
+#else
+static void
+unpack_async_after(uv_work_t *req) {
+#endif
+    HandleScope scope;
+
+    UnpackWork *w = static_cast<UnpackWork *>(req->data);
+    Handle<Value> argv[2] = { Null(), Undefined() };
+
+    if (w->ret == MSGPACK_UNPACK_PARSE_ERROR) {
+        argv[0] = Exception::Error(
+            String::New("Error de-serializing object"));
+    } else if (w->ret == MSGPACK_UNPACK_CONTINUE && w->truncated) {
+        argv[0] = Exception::RangeError(
+            String::New("Unpacked size exceeds maxBytes"));
+    } else if (w->ret != MSGPACK_UNPACK_CONTINUE) {
+        UnpackContext ctx;
+        init_unpack_context(Local<Object>::New(w->buffer), w->options, &ctx);
+
+        try {
+            argv[1] = msgpack_to_v8(&w->object, &ctx);
+        } catch (MsgpackException e) {
+            argv[0] = e.getThrownException();
+        }
+    }
+
+    Local<Function> cb = Local<Function>::New(w->callback);
+
+    msgpack_zone_destroy(&w->zone);
+    w->buffer.Dispose();
+    w->options.Dispose();
+    w->callback.Dispose();
+    delete w;
+
+    MakeCallback(Context::GetCurrent()->Global(), cb, 2, argv);
+}
+
+// msgpack.unpackAsync(buf[, options], cb);
+//
+// Unpack the object at the start of buf like unpack() does, but parse it on
+// the thread pool, then call cb(err, obj) on the main thread. obj is
+// undefined if buf does not hold a complete object. buf must not be
+// modified until cb has been called. The options are those of unpack(),
+// except that the nesting limit is always 512, and that zoneChunkSize sets
+// the size of the first chunk of memory for the tree that is parsed, which
+// is otherwise guessed from the size of buf. The container counts are
+// vetted against the size of buf before the thread pool allocates for them,
+// but maxLength and maxStringLength are only applied on the main thread.
+static Handle<Value>
+unpackAsync(const Arguments &args) {
+    HandleScope scope;
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be a Buffer")));
+    }
+
+    Local<Value> cb = args[args.Length() - 1];
+    if (args.Length() < 2 || !cb->IsFunction()) {
+        return ThrowException(Exception::TypeError(
+            String::New("Last argument must be a callback function")));
+    }
+
+    Local<Object> buf = args[0]->ToObject();
+    Local<Value> options = args.Length() > 2 ?
+        args[1] : Local<Value>::New(Undefined());
+
+    UnpackOptions opts;
+    parse_unpack_options(options, &opts);
+
+    size_t len = min(Buffer::Length(buf), opts.max_bytes);
+
+    // One chunk should hold the whole tree, unless it is a very large one
+    size_t chunk_size = opts.zone_chunk_size;
+    if (chunk_size == 0) {
+        chunk_size = MSGPACK_ZONE_CHUNK_SIZE_MAX;
+        if (len < MSGPACK_ZONE_CHUNK_SIZE_MAX / ZONE_BYTES_PER_INPUT_BYTE) {
+            chunk_size = max(static_cast<size_t>(MSGPACK_ZONE_CHUNK_SIZE),
+                             len * ZONE_BYTES_PER_INPUT_BYTE);
+        }
+    }
+
+    UnpackWork *w = new UnpackWork();
+    if (!msgpack_zone_init(&w->zone, chunk_size)) {
+        delete w;
+        return ThrowException(Exception::Error(
+            String::New("Out of memory")));
+    }
+
+    w->req.data = w;
+    w->buffer = Persistent<Object>::New(buf);
+    w->options = Persistent<Value>::New(options);
+    w->callback = Persistent<Function>::New(Local<Function>::Cast(cb));
+    w->data = Buffer::Data(buf);
+    w->len = len;
+    w->truncated = len < Buffer::Length(buf);
+
+    uv_queue_work(uv_default_loop(), &w->req,
+                  unpack_async_work, unpack_async_after);
+
+    return Undefined();
+}
+
+// Read the header of the raw, array or map (as given by type) at data + off.
+// Returns 1 and sets *n to its length and *pos to the offset just past the
+// header, 0 if the input ends within the header, or -1 if the value there is
+// of some other type.
+static int
+read_header(const char *data, size_t len, size_t off, msgpack_object_type type,
+            uint32_t *n, size_t *pos) {
+    uint8_t fix_mask, fix_type, op16;
+
+    switch (type) {
+    case MSGPACK_OBJECT_RAW:
+        fix_mask = 0xe0; fix_type = 0xa0; op16 = 0xda;
+        break;
+    case MSGPACK_OBJECT_ARRAY:
+        fix_mask = 0xf0; fix_type = 0x90; op16 = 0xdc;
+        break;
+    case MSGPACK_OBJECT_MAP:
+        fix_mask = 0xf0; fix_type = 0x80; op16 = 0xde;
+        break;
+    default:
+        return -1;
+    }
+
+    if (off >= len) {
+        return 0;
+    }
+
+    uint8_t b = static_cast<uint8_t>(data[off]);
+
+    if ((b & fix_mask) == fix_type) {
+        *n = b & ~fix_mask;
+        *pos = off + 1;
+    } else if (b == op16) {
+        if (len - off < 3) {
+            return 0;
+        }
+        *n = _msgpack_load16(uint16_t, data + off + 1);
+        *pos = off + 3;
+    } else if (b == op16 + 1) {
+        if (len - off < 5) {
+            return 0;
+        }
+        *n = _msgpack_load32(uint32_t, data + off + 1);
+        *pos = off + 5;
+    } else {
+        return -1;
+    }
+
+    return 1;
+}
+
+// unpackLazy() turns a map into an object whose properties are accessors,
+// each holding a slot array that says where its value is in the buffer. The
+// value is decoded the first time the property is read, and maps within it
+// are lazy in turn.
+#define LAZY_BUFFER 0
+#define LAZY_OFFSET 1
+#define LAZY_VALUE 2
+
+static Handle<Value> lazy_get(Local<String> name, const AccessorInfo &info);
+static void lazy_set(Local<String> name, Local<Value> value,
+                     const AccessorInfo &info);
+
+// Unpack the value at *off in buf, lazily if it is a map. Returns the same
+// as v8_unpack().
+static int
+lazy_unpack(Local<Object> buf, size_t *off, Local<Value> *result) {
+    const char *data = Buffer::Data(buf);
+    size_t len = Buffer::Length(buf);
+    UnpackContext ctx;
+
+    uint32_t n;
+    size_t pos;
+
+    int ret = read_header(data, len, *off, MSGPACK_OBJECT_MAP, &n, &pos);
+    if (ret < 0) {
+        return v8_unpack(data, len, off, &ctx, result);
+    }
+    if (ret == 0) {
+        return 0;
+    }
+
+    Local<Object> o = Object::New();
+
+    for (uint32_t i = 0; i < n; i++) {
+        HandleScope scope;
+        Local<Value> key;
+
+        ret = v8_unpack(data, len, &pos, &ctx, &key);
+        if (ret <= 0) {
+            return ret;
+        }
+
+        size_t value_off = pos;
+        ret = skip_value(data, len, &pos);
+        if (ret <= 0) {
+            return ret;
+        }
+
+        Local<Array> slot = Array::New(2);
+        slot->Set(LAZY_BUFFER, buf);
+        slot->Set(LAZY_OFFSET, Number::New(static_cast<double>(value_off)));
+        o->SetAccessor(key->ToString(), lazy_get, lazy_set, slot);
+    }
+
+    *off = pos;
+    *result = o;
+    return 1;
+}
+
+static Handle<Value>
+lazy_get(Local<String> name, const AccessorInfo &info) {
+    HandleScope scope;
+
+    Local<Array> slot = Local<Array>::Cast(info.Data());
+    if (slot->Has(LAZY_VALUE)) {
+        return scope.Close(slot->Get(LAZY_VALUE));
+    }
+
+    Local<Object> buf = slot->Get(LAZY_BUFFER)->ToObject();
+    size_t off = static_cast<size_t>(slot->Get(LAZY_OFFSET)->NumberValue());
+    Local<Value> v;
+
+    try {
+        if (lazy_unpack(buf, &off, &v) <= 0) {
+            throw MsgpackException("Error de-serializing object",
+                                   Exception::Error);
+        }
+    } catch (MsgpackException e) {
+        return ThrowException(e.getThrownException());
+    }
+
+    slot->Set(LAZY_VALUE, v);
+    return scope.Close(v);
+}
+
+static void
+lazy_set(Local<String> name, Local<Value> value, const AccessorInfo &info) {
+    Local<Array>::Cast(info.Data())->Set(LAZY_VALUE, value);
+}
+
+// var o = msgpack.unpackLazy(buf[, offset]);
+//
+// Like unpack(), except that maps are not decoded up front: their keys are
+// read, but each value is only unpacked when its property is first accessed.
+// Parts of the data that are never looked at are never decoded. buf must not
+// be modified while properties remain unread.
+static Handle<Value>
+unpackLazy(const Arguments &args) {
+    HandleScope scope;
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be a Buffer")));
+    }
+
+    Local<Object> buf = args[0]->ToObject();
+    size_t off = 0;
+
+    if (args.Length() > 1) {
+        off = args[1]->Uint32Value();
+
+        if (off > Buffer::Length(buf)) {
+            return ThrowException(Exception::RangeError(
+                String::New("Offset is out of bounds")));
+        }
+    }
+
+    Local<Value> result;
+    int ret;
+
+    try {
+        ret = lazy_unpack(buf, &off, &result);
+    } catch (MsgpackException e) {
+        return ThrowException(e.getThrownException());
+    }
+
+    if (ret == 0) {
+        return scope.Close(Undefined());
+    }
+
+    if (ret < 0) {
+        return ThrowException(Exception::Error(
+            String::New("Error de-serializing object")));
+    }
+
+    return scope.Close(result);
+}
+
+// Follow path into the value at data + *off, stepping over everything that
+// is not on the way. Returns 1 and moves *off to the value found, 0 if there
+// is no such value (or the input ends before it), or -1 if the input is
+// malformed.
+static int
+find_path(const char *data, size_t len, Local<Array> path, size_t *off) {
+    size_t pos = *off;
+
+    for (uint32_t i = 0; i < path->Length(); i++) {
+        HandleScope scope;
+        Local<Value> step = path->Get(i);
+        uint32_t n;
+        size_t next;
+
+        int ret = read_header(data, len, pos, MSGPACK_OBJECT_MAP, &n, &next);
+        if (ret > 0) {
+            String::Utf8Value key(step);
+            bool found = false;
+            pos = next;
+
+            for (uint32_t j = 0; j < n && !found; j++) {
+                uint32_t size;
+
+                ret = read_header(data, len, pos, MSGPACK_OBJECT_RAW, &size, &next);
+                if (ret == 0) {
+                    return 0;
+                }
+                if (ret > 0 && size == static_cast<uint32_t>(key.length())) {
+                    if (len - next < size) {
+                        return 0;
+                    }
+                    found = !memcmp(data + next, *key, size);
+                }
+
+                // The key, then the value unless it is the one
+                ret = skip_value(data, len, &pos);
+                if (ret > 0 && !found) {
+                    ret = skip_value(data, len, &pos);
+                }
+                if (ret <= 0) {
+                    return ret;
+                }
+            }
+
+            if (!found) {
+                return 0;
+            }
+            continue;
+        }
+
+        if (ret == 0) {
+            return 0;
+        }
+
+        ret = read_header(data, len, pos, MSGPACK_OBJECT_ARRAY, &n, &next);
+        if (ret <= 0 || !step->IsNumber() || step->Uint32Value() >= n) {
+            return 0;
+        }
+
+        pos = next;
+        for (uint32_t j = step->Uint32Value(); j > 0; j--) {
+            ret = skip_value(data, len, &pos);
+            if (ret <= 0) {
+                return ret;
+            }
+        }
+    }
+
+    *off = pos;
+    return 1;
+}
+
+// var v = msgpack.get(buf, path[, offset]);
+//
+// Return the value found by following path, an array of map keys and array
+// indices, into the object packed in buf; undefined is returned if there is
+// no such value. Only that value is decoded, the rest of the data is merely
+// stepped over, so this is far cheaper than unpack() when one field of a
+// large message is wanted.
+static Handle<Value>
+get_path(const Arguments &args) {
+    HandleScope scope;
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be a Buffer")));
+    }
+
+    if (args.Length() < 2 || !args[1]->IsArray()) {
+        return ThrowException(Exception::TypeError(
+            String::New("Second argument must be an Array")));
+    }
+
+    Local<Object> buf = args[0]->ToObject();
+    const char *data = Buffer::Data(buf);
+    size_t len = Buffer::Length(buf);
+    size_t off = 0;
+
+    if (args.Length() > 2) {
+        off = args[2]->Uint32Value();
+
+        if (off > len) {
+            return ThrowException(Exception::RangeError(
+                String::New("Offset is out of bounds")));
+        }
+    }
+
+    UnpackContext ctx;
+    Local<Value> result;
+    int ret;
+
+    try {
+        ret = find_path(data, len, Local<Array>::Cast(args[1]), &off);
+        if (ret > 0) {
+            ret = v8_unpack(data, len, &off, &ctx, &result);
+        }
+    } catch (MsgpackException e) {
+        return ThrowException(e.getThrownException());
+    }
+
+    if (ret == 0) {
+        return scope.Close(Undefined());
+    }
+
+    if (ret < 0) {
+        return ThrowException(Exception::Error(
+            String::New("Error de-serializing object")));
+    }
+
+    return scope.Close(result);
+}
+
+// var r = msgpack.validate(buf[, offset]);
+//
+// Check that buf holds a complete, well-formed object offset bytes in,
+// without decoding it; nothing is allocated unless it nests more than
+// MSGPACK_EMBED_STACK_SIZE deep. Returns {length, count, depth}: the size of
+// the object in bytes, the number of values in it (map keys included) and
+// how deeply its arrays and maps nest. If the data is malformed, {error} is
+// returned instead, with the offset of the offending byte, and undefined is
+// returned if buf ends before the object does.
+static Handle<Value>
+validate(const Arguments &args) {
+    static Persistent<String> length_symbol = NODE_PSYMBOL("length");
+    static Persistent<String> count_symbol = NODE_PSYMBOL("count");
+    static Persistent<String> depth_symbol = NODE_PSYMBOL("depth");
+    static Persistent<String> error_symbol = NODE_PSYMBOL("error");
+
+    HandleScope scope;
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be a Buffer")));
+    }
+
+    Local<Object> buf = args[0]->ToObject();
+    size_t len = Buffer::Length(buf);
+    size_t start = 0;
+
+    if (args.Length() > 1) {
+        start = args[1]->Uint32Value();
+
+        if (start > len) {
+            return ThrowException(Exception::RangeError(
+                String::New("Offset is out of bounds")));
+        }
+    }
+
+    skip_template_context tc;
+    skip_template_init(&tc);
+    tc.user.count = 0;
+
+    size_t off = start;
+    int ret = skip_template_execute(&tc, Buffer::Data(buf), len, &off);
+    skip_template_destroy(&tc);
+
+    if (ret == 0) {
+        return scope.Close(Undefined());
+    }
+
+    Local<Object> r = Object::New();
+
+    if (ret < 0) {
+        r->Set(error_symbol, Number::New(static_cast<double>(off)));
+    } else {
+        r->Set(length_symbol, Number::New(static_cast<double>(off - start)));
+        r->Set(count_symbol, Number::New(static_cast<double>(tc.user.count)));
+        r->Set(depth_symbol, Integer::NewFromUnsigned(tc.depth));
+    }
+
+    return scope.Close(r);
+}
+
+// var d = new msgpack.Decoder([options]);
+//
+// A decoder for a stream of packed objects that arrive in pieces, such as
+// the data events of a socket. Each piece is parsed once: the bytes of an
+// object that is still incomplete are kept together with the state of the
+// parser, which picks up where it left off when the next piece is written.
+//
+// The options are those of unpack(), other than buffers, and are read once
+// here. With stringTable, the table carries over from one object to the
+// next, as it does for the values of a single pack() call, and is only
+// emptied when the decoder starts afresh after an error.
+//
+// The bytes of an incomplete object are kept in a buffer sized by the
+// objects seen recently, so that a typical object is gathered without
+// reallocating and one huge object does not pin its memory for ever.
+#define DECODER_MIN_PENDING 1024
+
+class Decoder : public ObjectWrap {
+    public:
+        static Persistent<FunctionTemplate> constructor_template;
+
+        static void Initialize(Handle<Object> target);
+
+    private:
+        Decoder() : typical_size(0) {
+            v8_template_init(&tc);
+            reset();
+        }
+
+        ~Decoder() {
+            v8_template_destroy(&tc);
+            live.Dispose();
+            strings.Dispose();
+        }
+
+        void reset();
+        void finish_object(size_t size);
+        void keep_pending(const char *data, size_t off, size_t len);
+
+        static Handle<Value> New(const Arguments &args);
+        static Handle<Value> Write(const Arguments &args);
+
+        UnpackOptions opts;
+        v8_template_context tc;
+        vector<char> pending;           // bytes not yet parsed
+        size_t object_bytes;            // bytes parsed of the current object
+        size_t typical_size;            // recent object sizes, on average
+        Persistent<Array> live;         // containers in tc between writes
+        Persistent<Array> strings;      // string table of the stream
+        uint32_t string_count;
+};
+
+Persistent<FunctionTemplate> Decoder::constructor_template;
+
+// Forget any partial object and start afresh
+void
+Decoder::reset() {
+    v8_template_destroy(&tc);
+    v8_template_init(&tc);
+    tc.max_depth = opts.max_depth;
+    tc.user.items_left = 0;         // kept count of, but not checked, here
+    pending.clear();
+    object_bytes = 0;
+    string_count = 0;
+
+    live.Dispose();
+    live.Clear();
+    strings.Dispose();
+    strings.Clear();
+}
+
+// Start on the next object after one of size bytes was completed
+void
+Decoder::finish_object(size_t size) {
+    typical_size = typical_size ? (3 * typical_size + size) / 4 : size;
+
+    v8_template_destroy(&tc);
+    v8_template_init(&tc);
+    tc.max_depth = opts.max_depth;
+    object_bytes = 0;
+}
+
+// Keep data[off, len) for the next write(); data may point into pending
+void
+Decoder::keep_pending(const char *data, size_t off, size_t len) {
+    size_t want = max(typical_size, static_cast<size_t>(DECODER_MIN_PENDING));
+
+    if (!pending.empty() && data == &pending[0]) {
+        pending.erase(pending.begin(), pending.begin() + off);
+    } else {
+        pending.assign(data + off, data + len);
+    }
+
+    if (pending.capacity() > 4 * max(want, pending.size())) {
+        vector<char>(pending).swap(pending);
+    }
+    if (!pending.empty() && pending.capacity() < want) {
+        pending.reserve(want);
+    }
+}
+
+Handle<Value>
+Decoder::New(const Arguments &args) {
+    HandleScope scope;
+
+    Decoder *d = new Decoder();
+    d->Wrap(args.This());
+
+    parse_unpack_options(args[0], &d->opts);
+    if (d->opts.buffers) {
+        return ThrowException(Exception::TypeError(
+            String::New("Decoder does not support the buffers option")));
+    }
+    d->tc.max_depth = d->opts.max_depth;
+
+    return args.This();
+}
+
+// var a = d.write(buf);
+//
+// Parses buf and returns an array of the objects that it completes, which
+// may be empty.
+Handle<Value>
+Decoder::Write(const Arguments &args) {
+    HandleScope scope;
+
+    Decoder *d = ObjectWrap::Unwrap<Decoder>(args.This());
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("First argument must be a Buffer")));
+    }
+
+    Local<Object> buf = args[0]->ToObject();
+    const char *data = Buffer::Data(buf);
+    size_t len = Buffer::Length(buf);
+
+    if (!d->pending.empty()) {
+        d->pending.insert(d->pending.end(), data, data + len);
+        data = &d->pending[0];
+        len = d->pending.size();
+    }
+
+    UnpackContext ctx;
+    ctx.opts = d->opts;
+    if (ctx.opts.string_table) {
+        ctx.strings = d->strings.IsEmpty() ?
+            Array::New() : Local<Array>::New(d->strings);
+        ctx.string_count = d->string_count;
+    }
+
+    d->tc.user.ctx = &ctx;
+    d->tc.user.len = len;
+    d->tc.user.streaming = true;
+
+    if (!d->live.IsEmpty()) {
+        v8_template_restore(&d->tc, Local<Array>::New(d->live));
+    }
+
+    Local<Array> values = Array::New();
+    uint32_t count = 0;
+    size_t off = 0;
+    size_t start = 0;
+
+    try {
+        while (off < len) {
+            Local<Value> result;
+
+            // The object so far has taken object_bytes, plus what this
+            // write has of it from start on
+            size_t end = len;
+            if (ctx.opts.max_bytes - d->object_bytes < len - start) {
+                end = start + (ctx.opts.max_bytes - d->object_bytes);
+            }
+
+            int ret = v8_unpack_execute(&d->tc, data, end, &off, &result);
+
+            // A raw value that cannot fit is refused without waiting for it
+            if (ret == 0 && (end < len ||
+                (d->tc.cs == ACS_RAW_VALUE && d->object_bytes + (off - start) +
+                 d->tc.trail > ctx.opts.max_bytes))) {
+                throw MsgpackException("Unpacked size exceeds maxBytes",
+                                       Exception::RangeError);
+            }
+
+            if (ret == 0) {
+                break;
+            }
+
+            if (ret < 0) {
+                d->reset();
+                return ThrowException(Exception::Error(
+                    String::New("Error de-serializing object")));
+            }
+
+            values->Set(count++, result);
+            d->finish_object(d->object_bytes + off - start);
+            start = off;
+        }
+    } catch (MsgpackException e) {
+        d->reset();
+        return ThrowException(e.getThrownException());
+    }
+
+    // Hold on to the partial object, if any, until the next write
+    d->object_bytes += off - start;
+    d->keep_pending(data, off, len);
+
+    d->live.Dispose();
+    d->live = Persistent<Array>::New(v8_template_save(&d->tc));
+
+    if (ctx.opts.string_table) {
+        d->strings.Dispose();
+        d->strings = Persistent<Array>::New(ctx.strings);
+        d->string_count = ctx.string_count;
+    }
+
+    return scope.Close(values);
+}
+
+void
+Decoder::Initialize(Handle<Object> target) {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+    constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+    constructor_template->SetClassName(String::NewSymbol("Decoder"));
+
+    NODE_SET_PROTOTYPE_METHOD(constructor_template, "write", Write);
+
+    target->Set(
+        String::NewSymbol("Decoder"),
+        constructor_template->GetFunction()
+    );
+}
+
+extern "C" void
+init(Handle<Object> target) {
+    HandleScope scope;
+
+    Local<Value> bv = Context::GetCurrent()->Global()->Get(
+        String::NewSymbol("Buffer")
+    );
+    assert(bv->IsFunction());
+    buffer_constructor = Persistent<Function>::New(
+        Local<Function>::Cast(bv)
+    );
+    shape_cache = Persistent<Array>::New(Array::New(SHAPE_CACHE_SIZE));
+
+    // Typed arrays are only used if this node has them
+    Local<Value> i32 = Context::GetCurrent()->Global()->Get(
+        String::NewSymbol("Int32Array")
+    );
+    Local<Value> f64 = Context::GetCurrent()->Global()->Get(
+        String::NewSymbol("Float64Array")
+    );
+    if (i32->IsFunction() && f64->IsFunction()) {
+        int32_array_constructor = Persistent<Function>::New(
+            Local<Function>::Cast(i32)
+        );
+        float64_array_constructor = Persistent<Function>::New(
+            Local<Function>::Cast(f64)
+        );
+    }
+
+    // And likewise Map, which needs --harmony
+    Local<Value> map = Context::GetCurrent()->Global()->Get(
+        String::NewSymbol("Map")
+    );
+    if (map->IsFunction()) {
+        Local<Function> f = Local<Function>::Cast(map);
+        Local<Value> set = f->Get(String::NewSymbol("prototype"))
+            ->ToObject()->Get(String::NewSymbol("set"));
+        if (set->IsFunction()) {
+            map_constructor = Persistent<Function>::New(f);
+            map_set_function = Persistent<Function>::New(
+                Local<Function>::Cast(set)
+            );
+        }
+    }
+
+    NODE_SET_METHOD(target, "pack", pack);
+    NODE_SET_METHOD(target, "packWithOptions", packWithOptions);
+    NODE_SET_METHOD(target, "packInto", packInto);
+    IncrementalPacker::Initialize(target);
+    PackedArray::Initialize(target);
+    Decoder::Initialize(target);
+
+    // Go through this mess rather than call NODE_SET_METHOD so that we can set
+    // a field on the function for 'bytes_remaining'.
+    msgpack_unpack_template = Persistent<FunctionTemplate>::New(
+        FunctionTemplate::New(unpack)
+    );
+    msgpack_unpack_function = Persistent<Function>::New(
+        msgpack_unpack_template->GetFunction()
+    );
+    target->Set(
+        String::NewSymbol("unpack"),
+        msgpack_unpack_function
+    );
+
+    NODE_SET_METHOD(target, "unpackAt", unpackAt);
+    NODE_SET_METHOD(target, "unpackAll", unpackAll);
+    NODE_SET_METHOD(target, "unpackAsync", unpackAsync);
+    NODE_SET_METHOD(target, "unpackLazy", unpackLazy);
+    NODE_SET_METHOD(target, "get", get_path);
+    NODE_SET_METHOD(target, "validate", validate);
 }
 
 NODE_MODULE(msgpackBinding, init);
@@ -167,6 +167,194 @@ exports.benchmark = {
     test.ok(1);
     test.done();
   },
+  'memory per element stays flat as a single array grows' : function (test) {
+    console.log();
+    // Handles are released every few hundred elements, so the memory it
+    // takes to convert one element should not grow with the array.
+    [10000, 100000, 1000000, 4000000].forEach(function(n) {
+      var a = new Array(n);
+      for (var i = 0; i < n; i++) {
+        a[i] = 'element' + (i % 100);
+      }
+
+      var rss = process.memoryUsage().rss;
+      var now = Date.now();
+      var mpBuf = msgpack.pack(a);
+      var packTime = Date.now() - now;
+      var packRss = process.memoryUsage().rss - rss;
+
+      rss = process.memoryUsage().rss;
+      now = Date.now();
+      msgpack.unpack(mpBuf);
+      var unpackTime = Date.now() - now;
+      var unpackRss = process.memoryUsage().rss - rss;
+
+      console.log(
+        n + ' elements: ' +
+        'pack ' + packTime + ' ms, ' +
+        (packRss / n).toFixed(1) + ' bytes/element; ' +
+        'unpack ' + unpackTime + ' ms, ' +
+        (unpackRss / n).toFixed(1) + ' bytes/element'
+      );
+    });
+
+    test.expect(1);
+    test.ok(1);
+    test.done();
+  },
+  'unpacking ascii strings against non-ascii strings' : function (test) {
+    console.log();
+    // String::New() finds ASCII input with a quick scan and builds a
+    // one-byte string from it; anything else takes the full UTF-8 decode.
+    [['ascii', 'abcdefghij'], ['non-ascii', 'abcdefgh\u00e9']].forEach(function(c) {
+      var a = [];
+      for (var i = 0; i < 1000000; i++) {
+        a.push(c[1] + i);
+      }
+
+      var mpBuf = msgpack.pack(a);
+      var now = Date.now();
+      msgpack.unpack(mpBuf);
+      console.log(c[0] + ' strings: unpack ' + (Date.now() - now) + ' ms');
+    });
+
+    test.expect(1);
+    test.ok(1);
+    test.done();
+  },
+  'unpacking shallow documents against deeply nested ones' : function (test) {
+    console.log();
+    // The parser stack is embedded in its context for the first 32 levels
+    // and moves to the heap beyond, so shallow documents should cost no
+    // more per level than they used to, and deep ones only a little more.
+    [2, 8, 31, 64, 256].forEach(function(depth) {
+      var o = 1;
+      for (var i = 0; i < depth; i++) {
+        o = [o];
+      }
+
+      var mpBuf = msgpack.pack(o);
+      var n = Math.floor(4000000 / depth);
+      var now = Date.now();
+      for (var i = 0; i < n; i++) {
+        msgpack.unpack(mpBuf);
+      }
+      var unpackTime = Date.now() - now;
+
+      console.log(
+        'depth ' + depth + ': ' + n + ' unpacks in ' + unpackTime + ' ms, ' +
+        (unpackTime * 1e6 / (n * depth)).toFixed(1) + ' ns/level'
+      );
+    });
+
+    test.expect(1);
+    test.ok(1);
+    test.done();
+  },
+  'validating against unpacking a 1m element array of objects' : function (test) {
+    console.log();
+    var mpBuf = msgpack.pack(DATA);
+    var mb = mpBuf.length / (1024 * 1024);
+
+    for (var i = 0; i < 3; i++) {
+      var now = Date.now();
+      msgpack.validate(mpBuf);
+      var validateTime = Date.now() - now;
+
+      now = Date.now();
+      msgpack.unpack(mpBuf);
+      var unpackTime = Date.now() - now;
+
+      console.log(
+        'validate: ' + validateTime + ' ms (' +
+        (mb * 1000 / Math.max(validateTime, 1)).toFixed(0) + ' MB/s), ' +
+        'unpack: ' + unpackTime + ' ms'
+      );
+    }
+
+    test.expect(1);
+    test.ok(1);
+    test.done();
+  },
+  'unpacking large strings with and without externalStrings' : function (test) {
+    console.log();
+    var a = [];
+    for (var i = 0; i < 10000; i++) {
+      a.push(new Array(4097).join(String.fromCharCode(97 + i % 26)));
+    }
+    var mpBuf = msgpack.pack(a);
+
+    [{}, {externalStrings: true}].forEach(function(opts) {
+      var now = Date.now();
+      var heap = process.memoryUsage().heapUsed;
+      var r = msgpack.unpack(mpBuf, opts);
+      console.log(
+        (opts.externalStrings ? 'external' : 'heap    ') + ' strings: unpack ' +
+        (Date.now() - now) + ' ms, V8 heap +' +
+        ((process.memoryUsage().heapUsed - heap) / 1048576).toFixed(1) + ' MB'
+      );
+    });
+
+    test.expect(1);
+    test.ok(1);
+    test.done();
+  },
+  'unpacking records of one shape against alternating shapes' : function (test) {
+    console.log();
+    // Maps are cached by their first key and number of pairs, so {type, x}
+    // and {type, y} records share a slot; alternating them should cost
+    // little more than records of a single shape.
+    [['one shape', 1], ['alternating', 2], ['one-off', 0]].forEach(function(c) {
+      var a = [];
+      for (var i = 0; i < 1000000; i++) {
+        var o = {type: i % 7};
+        if (c[1] === 0) {
+          o['k' + i] = i;
+        } else if (i % c[1]) {
+          o.y = i;
+        } else {
+          o.x = i;
+        }
+        a.push(o);
+      }
+
+      var mpBuf = msgpack.pack(a);
+      var now = Date.now();
+      msgpack.unpack(mpBuf);
+      console.log(c[0] + ': unpack ' + (Date.now() - now) + ' ms');
+    });
+
+    test.expect(1);
+    test.ok(1);
+    test.done();
+  },
+  'unpacking a large lookup table as an object against a Map' : function (test) {
+    console.log();
+    var o = {};
+    for (var i = 0; i < 200000; i++) {
+      o['key' + i] = i;
+    }
+    var mpBuf = msgpack.pack(o);
+
+    var runs = [{}];
+    if (typeof Map === 'function') {
+      runs.push({maps: true});
+    } else {
+      console.log('Map is not available; run node with --harmony to compare');
+    }
+
+    runs.forEach(function(opts) {
+      var now = Date.now();
+      msgpack.unpack(mpBuf, opts);
+      console.log(
+        (opts.maps ? 'Map:    ' : 'object: ') + (Date.now() - now) + ' ms'
+      );
+    });
+
+    test.expect(1);
+    test.ok(1);
+    test.done();
+  },
   'output above is from three runs of 1m individual calls' : function (test) {
     console.log();
     for (var i = 0; i < 3; i++) {
@@ -261,5 +261,509 @@ exports.msgpack = {
     test.expect(1);
     test.deepEqual(expect, msgpack.unpack(msgpack.pack(subject)));
     test.done();
+  },
+  'test string table round trip' : function (test) {
+    test.expect(3);
+    var o = [];
+    for (var i = 0; i < 100; i++) {
+      o.push({ host : 'web' + (i % 3) + '.example.com', status : 'OK' });
+    }
+    var plain = msgpack.pack(o);
+    var b = msgpack.packWithOptions({ stringTable : true }, o);
+    test.ok(b.length < plain.length / 2, 'expected a smaller buffer');
+    test.deepEqual(o, msgpack.unpack(b, { stringTable : true }));
+    test.deepEqual(o, msgpack.unpack(msgpack.packWithOptions({}, o)));
+    test.done();
+  },
+  'test string table references use fixext headers' : function (test) {
+    test.expect(2);
+    var b = msgpack.packWithOptions({ stringTable : true }, ['xxxx', 'xxxx']);
+    test.equal(b.toString('hex'), '92a478787878d40000');
+    var o = [];
+    for (var i = 0; i < 257; i++) {
+      o.push('s' + (1000 + i).toString().slice(1));
+    }
+    o.push(o[256]);
+    b = msgpack.packWithOptions({ stringTable : true }, o);
+    test.equal(b.slice(b.length - 4).toString('hex'), 'd5000100');
+    test.done();
+  },
+  'test string table references require the unpack option' : function (test) {
+    test.expect(1);
+    var b = msgpack.packWithOptions(
+      { stringTable : true },
+      ['repeated', 'repeated']
+    );
+    test.throws(function () { msgpack.unpack(b); });
+    test.done();
+  },
+  'test pack keeps Buffers made by toJSON alive' : function (test) {
+    test.expect(1);
+    var o = [];
+    for (var i = 0; i < 5000; i++) {
+      o.push({ toJSON : function () { return new Buffer(new Array(65).join('z')); } });
+    }
+    var b = msgpack.pack(o);
+    var expected = [];
+    for (i = 0; i < 5000; i++) {
+      expected.push(new Array(65).join('z'));
+    }
+    test.deepEqual(expected, msgpack.unpack(b));
+    test.done();
+  },
+  'test incremental pack gives the same bytes as pack' : function (test) {
+    test.expect(3);
+    var o = [];
+    for (var i = 0; i < 1000; i++) {
+      o.push({ a : [i, -i, i / 3], b : 'str' + i, c : { d : null, e : true } });
+    }
+    var packer = new msgpack.IncrementalPacker(o);
+    var steps = 0;
+    while (!packer.step(100)) {
+      steps++;
+    }
+    test.ok(steps > 10, 'expected many steps');
+    test.deepEqual(msgpack.pack(o), packer.buffer());
+
+    msgpack.packIncremental(o, { maxNodes : 50 }, function (err, buf) {
+      test.deepEqual(msgpack.pack(o), buf);
+      test.done();
+    });
+  },
+  'test incremental pack reuses its zone between steps' : function (test) {
+    test.expect(1);
+    var o = [];
+    for (var i = 0; i < 200; i++) {
+      o.push(new Array(3000).join(String.fromCharCode(97 + i % 26)) + i);
+    }
+    var packer = new msgpack.IncrementalPacker(o);
+    while (!packer.step(20)) {}
+    test.deepEqual(msgpack.pack(o), packer.buffer());
+    test.done();
+  },
+  'test incremental pack detects circular references' : function (test) {
+    test.expect(1);
+    var d = {};
+    d.qqq = d;
+    msgpack.packIncremental(d, function (err, buf) {
+      test.equal(
+        err.message,
+        'Cowardly refusing to pack object with circular reference'
+      );
+      test.done();
+    });
+  },
+  'test maxBytes allows output up to the limit' : function (test) {
+    test.expect(2);
+    var o = { a : [1, 2, 3], b : 'cdef', c : -1243.111 };
+    var b = msgpack.pack(o);
+    test.deepEqual(b, msgpack.packWithOptions({ maxBytes : b.length }, o));
+    test.throws(function () {
+      msgpack.packWithOptions({ maxBytes : b.length - 1 }, o);
+    }, RangeError);
+    test.done();
+  },
+  'test maxBytes aborts before traversing the whole object' : function (test) {
+    test.expect(2);
+    var visited = 0;
+    var o = [];
+    for (var i = 0; i < 1000; i++) {
+      o.push({ toJSON : function () { visited++; return 'xxxxxxxxxx'; } });
+    }
+    try {
+      msgpack.packWithOptions({ maxBytes : 100 }, o);
+    } catch (e) {
+      test.equal(e.message, 'Packed size exceeds maxBytes');
+    }
+    test.ok(visited < 20, 'expected to stop early');
+    test.done();
+  },
+  'test packed array append upgrades the header' : function (test) {
+    test.expect(5);
+    var a = new msgpack.PackedArray();
+    var o = [];
+    test.deepEqual([], msgpack.unpack(a.buffer()));
+    for (var i = 0; i < 70000; i++) {
+      o.push(i % 7 ? i : { event : i });
+      a.push(o[i]);
+      if (i == 14 || i == 15) {
+        test.deepEqual(msgpack.pack(o), a.buffer());
+      }
+    }
+    test.deepEqual(msgpack.pack(o), a.buffer());
+    test.deepEqual(o, msgpack.unpack(a.buffer()));
+    test.done();
+  },
+  'test packed array append to an existing buffer' : function (test) {
+    test.expect(2);
+    var a = new msgpack.PackedArray(msgpack.pack([1, 'two']));
+    test.equal(4, a.push(3, { four : 4 }));
+    a.pushPacked(msgpack.pack('five'));
+    test.deepEqual([1, 'two', 3, { four : 4 }, 'five'], msgpack.unpack(a.buffer()));
+    test.done();
+  },
+  'test packInto writes into the given buffer' : function (test) {
+    test.expect(4);
+    var o = { a : [1, 2, 3], b : 'cdef' };
+    var expect = msgpack.pack(o, 'x');
+    var buf = new Buffer(expect.length + 10);
+    var n = msgpack.packInto(buf, 10, o, 'x');
+    test.equal(expect.length, n);
+    test.deepEqual(expect, buf.slice(10));
+    test.deepEqual(o, msgpack.unpack(buf, 10));
+    test.throws(function () {
+      msgpack.packInto(buf, 11, o, 'x');
+    }, RangeError);
+    test.done();
+  },
+  'test unpacking from an offset' : function (test) {
+    test.expect(3);
+    var buf = msgpack.pack([1, 2], 'abc', { d : 4 });
+    var a = msgpack.unpack(buf);
+    test.deepEqual('abc', msgpack.unpack(buf, buf.length - msgpack.unpack.bytes_remaining));
+    test.deepEqual({ d : 4 }, msgpack.unpack(buf, buf.length - msgpack.unpack.bytes_remaining));
+    test.equal(0, msgpack.unpack.bytes_remaining);
+    test.done();
+  },
+  'test unpacking values that span many input chunks' : function (test) {
+    test.expect(2);
+    var o = { list : [], text : new Array(40000).join('x') };
+    for (var i = 0; i < 5000; i++) {
+      o.list.push({ id : i, name : 'item ' + i, tags : ['a', 'b'] });
+    }
+    o.last = true;
+    test.deepEqual(o, msgpack.unpack(msgpack.pack(o)));
+    test.strictEqual(undefined, msgpack.unpack(msgpack.pack(o).slice(0, 30000)));
+    test.done();
+  },
+  'test unpacking an impossible array length fails' : function (test) {
+    test.expect(1);
+    test.throws(function () {
+      msgpack.unpack(new Buffer([0xdd, 0xff, 0xff, 0xff, 0xff, 0x01]));
+    });
+    test.done();
+  },
+  'test unpacking nested array lengths that only fit one at a time' : function (test) {
+    test.expect(2);
+    var buf = new Buffer(0x100010);
+    buf.fill(0);
+    new Buffer([0xdd, 0x00, 0x0f, 0xff, 0xff]).copy(buf, 0);
+    new Buffer([0xdd, 0x00, 0x0f, 0xff, 0xff]).copy(buf, 5);
+    test.throws(function () { msgpack.unpack(buf); });
+    msgpack.unpackAsync(buf, function (err, result) {
+      test.ok(err instanceof Error);
+      test.done();
+    });
+  },
+  'test unpacking similar map keys' : function (test) {
+    test.expect(2);
+    var o = [];
+    for (var i = 0; i < 100; i++) {
+      o.push({ abc : i, axc : -i, ac : 'v', '' : null, 'ab\u00e9c' : i });
+    }
+    test.deepEqual(o, msgpack.unpack(msgpack.pack(o)));
+    test.deepEqual(o, msgpack.unpack(msgpack.pack(o)));
+    test.done();
+  },
+  'test lazy unpack decodes properties on access' : function (test) {
+    test.expect(5);
+    var o = { headers : { route : 'a.b', id : 7 }, body : [1, { x : 'y' }], n : null };
+    var buf = msgpack.pack(o);
+    var l = msgpack.unpackLazy(buf);
+    test.equal('a.b', l.headers.route);
+    test.deepEqual(o, l);
+    l.n = 5;
+    test.equal(5, l.n);
+    test.deepEqual([1, 2], msgpack.unpackLazy(msgpack.pack([1, 2])));
+    test.strictEqual(undefined, msgpack.unpackLazy(buf.slice(0, buf.length - 1)));
+    test.done();
+  },
+  'test get a nested value by path' : function (test) {
+    test.expect(6);
+    var o = { body : [1, 2, 3], headers : { id : 7, route : 'a.b' }, ids : [{ x : 1 }, { x : 2 }] };
+    var buf = msgpack.pack(o);
+    test.equal('a.b', msgpack.get(buf, ['headers', 'route']));
+    test.deepEqual({ x : 2 }, msgpack.get(buf, ['ids', 1]));
+    test.equal(2, msgpack.get(buf, ['ids', 1, 'x']));
+    test.deepEqual(o, msgpack.get(buf, []));
+    test.strictEqual(undefined, msgpack.get(buf, ['headers', 'nope']));
+    test.strictEqual(undefined, msgpack.get(buf, ['body', 3]));
+    test.done();
+  },
+  'test unpacking raw values as buffers' : function (test) {
+    test.expect(5);
+    var buf = msgpack.pack({ data : new Buffer([0, 255, 128, 7]), name : 'abcd' });
+    var o = msgpack.unpack(buf, { buffers : true });
+    test.ok(Buffer.isBuffer(o.data));
+    test.deepEqual([0, 255, 128, 7], Array.prototype.slice.call(o.data));
+    test.equal('abcd', o.name.toString());
+    buf[buf.length - 1] = 0x65;
+    test.equal('abce', o.name.toString());
+    test.deepEqual(['data', 'name'], Object.keys(o));
+    test.done();
+  },
+  'test unpacking all concatenated objects' : function (test) {
+    test.expect(4);
+    var buf = msgpack.pack([1, 2], 0, 'abc', { d : null });
+    var a = msgpack.unpackAll(buf);
+    test.deepEqual([[1, 2], 0, 'abc', { d : null }], a);
+    test.equal(0, a.bytes_remaining);
+    a = msgpack.unpackAll(buf.slice(0, buf.length - 2));
+    test.deepEqual([[1, 2], 0, 'abc'], a);
+    test.equal(buf.length - 2 - msgpack.pack([1, 2], 0, 'abc').length, a.bytes_remaining);
+    test.done();
+  },
+  'test unpacking at offsets with a reused result' : function (test) {
+    test.expect(5);
+    var buf = msgpack.pack([1, 2], 'abc', { d : 4 });
+    var r = {}, values = [];
+    for (var off = 0; msgpack.unpackAt(buf, off, r); off = r.offset) {
+      values.push(r.value);
+    }
+    test.deepEqual([[1, 2], 'abc', { d : 4 }], values);
+    test.equal(buf.length, off);
+    test.deepEqual({ value : 'abc', offset : 7 }, msgpack.unpackAt(buf, 3));
+    test.strictEqual(undefined, msgpack.unpackAt(buf.slice(0, 5), 3));
+    var b = msgpack.unpackAt(buf, 3, null, { buffers : true }).value;
+    test.ok(Buffer.isBuffer(b));
+    test.done();
+  },
+  'test decoder reassembles objects split across writes' : function (test) {
+    test.expect(3);
+    var objs = [{ a : [1, 2, { b : 'cdef' }], s : new Array(100).join('x') }, 0, 'end'];
+    var buf = msgpack.pack.apply(null, objs);
+    var d = new msgpack.Decoder(), out = [];
+    for (var i = 0; i < buf.length; i++) {
+      out = out.concat(d.write(buf.slice(i, i + 1)));
+    }
+    test.deepEqual(objs, out);
+    test.deepEqual(objs, new msgpack.Decoder().write(buf));
+    test.throws(function () {
+      d.write(new Buffer([0xc1]));
+    });
+    test.done();
+  },
+  'test decoder with a string table for the whole stream' : function (test) {
+    test.expect(2);
+    var o = ['abcd', 'abcd', { abcd : 'efgh' }];
+    var p = ['efgh', { efgh : 'abcd' }];
+    var buf = msgpack.packWithOptions({ stringTable : true }, o, p);
+    test.deepEqual([o, p], msgpack.unpackAll(buf, { stringTable : true }));
+    var d = new msgpack.Decoder({ stringTable : true });
+    var out = d.write(buf.slice(0, 7)).concat(d.write(buf.slice(7)));
+    test.deepEqual([o, p], out);
+    test.done();
+  },
+  'test unpacking integers around the 32-bit limits' : function (test) {
+    test.expect(1);
+    var a = [0, 127, -32, -33, 65535, 2147483647, -2147483648, 4294967295,
+             4294967296, -2147483649, 9007199254740992, -9007199254740992];
+    test.deepEqual(a, msgpack.unpack(msgpack.pack(a)));
+    test.done();
+  },
+  'test unpacking a large array after a map at the same depth' : function (test) {
+    test.expect(1);
+    var big = [];
+    for (var i = 0; i < 20000; i++) {
+      big.push(i);
+    }
+    var o = [{ a : 1, b : 2 }, big, { c : 3 }];
+    test.deepEqual(o, msgpack.unpack(msgpack.pack(o)));
+    test.done();
+  },
+  'test unpacking maps that share and break a shape' : function (test) {
+    test.expect(2);
+    var a = [];
+    for (var i = 0; i < 10; i++) {
+      a.push({ id : i, name : 'n' + i, '19' : [i], sub : { x : i } });
+    }
+    a.push({ id : 1, name : 'other', kind : 3, sub : {} });
+    a.push({ id : 2, x : 1, y : 2, z : 3 });
+    a.push({ id : 3, id2 : 1, id3 : 2, id4 : 3 });
+    a.push({ id : 4, name : 'n', '19' : [], sub : { x : 0 } });
+    var b = msgpack.unpack(msgpack.pack(a));
+    test.deepEqual(a, b);
+    test.deepEqual(Object.keys(a[12]), Object.keys(b[12]));
+    test.done();
+  },
+  'test unpacking numeric arrays as typed arrays' : function (test) {
+    test.expect(6);
+    var doubles = [], ints = [], mixed = [];
+    for (var i = 0; i < 10000; i++) {
+      doubles.push(i + 0.5);
+      ints.push(i % 2 ? -i * 1000 : i);
+    }
+    mixed = ints.slice(0, 20).concat(['x']);
+    var o = msgpack.unpack(
+      msgpack.pack({ d : doubles, i : ints, m : mixed, s : [1.5, 2] }),
+      { typedArrays : true }
+    );
+    test.ok(o.d instanceof Float64Array);
+    test.deepEqual(doubles, Array.prototype.slice.call(o.d));
+    test.ok(o.i instanceof Int32Array);
+    test.deepEqual(ints, Array.prototype.slice.call(o.i));
+    test.deepEqual(mixed, o.m);
+    test.deepEqual([1.5, 2], o.s);
+    test.done();
+  },
+  'test typed arrays with overlong counts and split headers' : function (test) {
+    test.expect(5);
+    var bad = new Buffer(20000);
+    bad.fill(0x01);
+    new Buffer([0xdd, 0x55, 0x55, 0x8e, 0x34]).copy(bad);
+    test.throws(function () {
+      msgpack.unpack(bad, { typedArrays : true });
+    });
+
+    var doubles = [];
+    for (var i = 0; i < 100; i++) {
+      doubles.push(i + 0.5);
+    }
+    var buf = msgpack.pack(doubles);
+    [2, 10].forEach(function (split) {
+      var d = new msgpack.Decoder({ typedArrays : true });
+      var out = d.write(buf.slice(0, split)).concat(d.write(buf.slice(split)));
+      test.equal(out.length, 1);
+      test.deepEqual(doubles, Array.prototype.slice.call(out[0]));
+    });
+    test.done();
+  },
+  'test unpacking nesting deeper than the embedded stack' : function (test) {
+    var o = 'bottom';
+    for (var i = 0; i < 200; i++) {
+      o = (i % 2) ? [o] : {a: o};
+    }
+    var buf = msgpack.pack(o);
+    test.expect(4);
+    test.deepEqual(msgpack.unpack(buf), o);
+    test.deepEqual(msgpack.unpack(buf, {maxDepth: 200}), o);
+    test.throws(function () { msgpack.unpack(buf, {maxDepth: 199}); });
+    var d = new msgpack.Decoder({maxDepth: 200});
+    test.deepEqual(d.write(buf.slice(0, 150)).concat(d.write(buf.slice(150))), [o]);
+    test.done();
+  },
+  'test unpacking on the thread pool' : function (test) {
+    var o = {a: [1, 2.5, -3, 'x', null, true], b: {c: 'd'}, e: 4294967296};
+    test.expect(5);
+    msgpack.unpackAsync(msgpack.pack(o), function (err, result) {
+      test.equal(err, null);
+      test.deepEqual(result, o);
+      msgpack.unpackAsync(new Buffer([0x93, 0x01]), function (err, result) {
+        test.equal(result, undefined);
+        msgpack.unpackAsync(new Buffer([0xc1]), function (err, result) {
+          test.ok(err instanceof Error);
+          test.equal(result, undefined);
+          test.done();
+        });
+      });
+    });
+  },
+  'test unpacking a string table on the thread pool' : function (test) {
+    var o = [{abcd: 'efgh'}, {efgh: 'abcd', ijkl: 'mnop'}, {mnop: 'ijkl'}];
+    var buf = msgpack.packWithOptions({stringTable: true}, o);
+    test.expect(2);
+    msgpack.unpackAsync(buf, {stringTable: true}, function (err, result) {
+      test.equal(err, null);
+      test.deepEqual(result, o);
+      test.done();
+    });
+  },
+  'test validating without unpacking' : function (test) {
+    var buf = msgpack.pack(7, [1, [2, {a: 3}]]);
+    test.expect(5);
+    test.deepEqual(msgpack.validate(buf), {length: 1, count: 1, depth: 0});
+    test.deepEqual(msgpack.validate(buf, 1), {length: 8, count: 7, depth: 3});
+    test.equal(msgpack.validate(buf.slice(0, 5), 1), undefined);
+    test.deepEqual(msgpack.validate(new Buffer([0x92, 0x01, 0xc1])), {error: 2});
+    test.throws(function () { msgpack.validate(buf, 10); });
+    test.done();
+  },
+  'test unpacking with size limits' : function (test) {
+    var buf = msgpack.pack({a: [1, 2, 3], b: 'hello'});
+    test.expect(7);
+    test.deepEqual(msgpack.unpack(buf, {maxLength: 3, maxStringLength: 5,
+                                        maxBytes: buf.length}),
+                   {a: [1, 2, 3], b: 'hello'});
+    test.throws(function () { msgpack.unpack(buf, {maxLength: 2}); }, RangeError);
+    test.throws(function () { msgpack.unpack(buf, {maxStringLength: 4}); }, RangeError);
+    test.throws(function () { msgpack.unpack(buf, {maxBytes: buf.length - 1}); }, RangeError);
+    // A 5-byte header claiming 4G elements fails without allocating for them
+    test.throws(function () {
+      msgpack.unpack(new Buffer([0xdd, 0xff, 0xff, 0xff, 0xff]), {maxLength: 1000});
+    }, RangeError);
+    var d = new msgpack.Decoder({maxBytes: 64});
+    test.throws(function () { d.write(new Buffer([0xdb, 0, 0, 1, 0])); }, RangeError);
+    test.deepEqual(d.write(buf), [{a: [1, 2, 3], b: 'hello'}]);
+    test.done();
+  },
+  'test packing and unpacking with a small zone chunk size' : function (test) {
+    var o = [];
+    for (var i = 0; i < 5000; i++) {
+      o.push({id: i, tags: ['a', 'b'], name: 'item' + i});
+    }
+    var buf = msgpack.packWithOptions({zoneChunkSize: 16}, o);
+    test.expect(4);
+    test.deepEqual(buf, msgpack.pack(o));
+    // A huge size is capped rather than allocated
+    test.deepEqual(msgpack.packWithOptions({zoneChunkSize: 4e9}, o), buf);
+    msgpack.unpackAsync(buf, {zoneChunkSize: 16}, function (err, result) {
+      test.equal(err, null);
+      test.deepEqual(result, o);
+      test.done();
+    });
+  },
+  'test unpacking large strings as external strings' : function (test) {
+    var ascii = new Array(2001).join('x'), other = new Array(2001).join('\u00e9');
+    var o = {a: ascii, b: other, c: 'short'};
+    test.expect(2);
+    var result = msgpack.unpack(msgpack.pack(o), {externalStrings: true});
+    test.deepEqual(result, o);
+    test.equal(result.a + result.c, ascii + 'short');
+    test.done();
+  },
+  'test unpacking maps as ES Maps' : function (test) {
+    // {two: 2, __proto__: 5, 1: 'one'}, whose integer key comes last, one
+    // with string keys, then {b: 1, c: 2, 3: 'x'}
+    var buf = new Buffer([0x93, 0x83, 0xa3, 0x74, 0x77, 0x6f, 0x02,
+                          0xa9, 0x5f, 0x5f, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x5f, 0x5f, 0x05,
+                          0x01, 0xa3, 0x6f, 0x6e, 0x65,
+                          0x81, 0xa1, 0x61, 0x01,
+                          0x83, 0xa1, 0x62, 0x01, 0xa1, 0x63, 0x02, 0x03, 0xa1, 0x78]);
+    var tabled = msgpack.packWithOptions({stringTable: true},
+                                         [{abcd: 1}, {abcd: 2}]);
+    if (typeof Map !== 'function') {
+      test.expect(1);
+      test.throws(function () { msgpack.unpack(buf, {maps: true}); });
+      test.done();
+      return;
+    }
+    var ordered = typeof Map.prototype.forEach === 'function';
+    test.expect(ordered ? 13 : 11);
+    function keys(m) {
+      var a = [];
+      m.forEach(function (v, k) { a.push(k); });
+      return a;
+    }
+    // Below the threshold, the maps only become Maps at their integer keys
+    var r = msgpack.unpack(buf, {maps: 10});
+    test.ok(r[0] instanceof Map);
+    test.equal(r[0].get(1), 'one');
+    test.equal(r[0].get('1'), undefined);
+    test.equal(r[0].get('two'), 2);
+    test.equal(r[0].get('__proto__'), 5);
+    test.deepEqual(r[1], {a: 1});
+    test.equal(r[2].get('b'), 1);
+    test.equal(r[2].get(3), 'x');
+    if (ordered) {
+      test.deepEqual(keys(r[0]), ['two', '__proto__', 1]);
+      test.deepEqual(keys(r[2]), ['b', 'c', 3]);
+    }
+    test.ok(msgpack.unpack(buf, {maps: true})[1] instanceof Map);
+    // String table references are string keys
+    msgpack.unpackAsync(tabled, {stringTable: true, maps: 10}, function (err, result) {
+      test.equal(err, null);
+      test.deepEqual(result, [{abcd: 1}, {abcd: 2}]);
+      test.done();
+    });
   }
 };